@@ -0,0 +1,34 @@
+#ifndef ACTIVATION_H
+#define ACTIVATION_H
+
+#include <string>
+#include <vector>
+
+// A nonlinearity and its derivative. The derivative takes the forward output rather than
+// the input, so backpropagation reuses the activations the forward pass already computed
+struct Activation
+{
+    const char *name;
+    double (*forward)(double input);
+    double (*derivative)(double output);
+};
+
+// sigmoid and tanh, each exact, as a clamped rational polynomial, or linearly interpolated
+// from a lookup table. Names are "sigmoid", "sigmoid-poly", "sigmoid-lut" and likewise for tanh
+const std::vector<Activation> &activations();
+// nullptr for an unknown name
+const Activation *find_activation(const std::string &name);
+// Exact sigmoid, what checkpoints without an activation were trained with
+const Activation &default_activation();
+
+double sigmoid(double input);
+double sigmoid_poly(double input);
+double sigmoid_lut(double input);
+double sigmoid_derivative(double output);
+
+double tanh_exact(double input);
+double tanh_poly(double input);
+double tanh_lut(double input);
+double tanh_derivative(double output);
+
+#endif // ACTIVATION_H
@@ -0,0 +1,139 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+// Bump allocator for short lived scratch memory. Allocating only moves an offset and
+// nothing is freed on its own; reset() gives everything back at once but keeps the
+// blocks, so a loop needing the same scratch every iteration stops calling malloc
+// after its first pass
+class Arena
+{
+public:
+    Arena(size_t block_size = 1 << 16) : m_block_size(block_size) {}
+    ~Arena()
+    {
+        for (Block &block : m_blocks)
+            free(block.data);
+    }
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    void *allocate(size_t size, size_t align)
+    {
+        for (;;)
+        {
+            if (m_current == m_blocks.size())
+            {
+                const size_t block_size = std::max(m_block_size, size + align);
+                char *data = (char *)malloc(block_size);
+                if (!data)
+                    throw std::bad_alloc();
+                m_blocks.push_back({data, block_size});
+            }
+
+            Block &block = m_blocks[m_current];
+            const size_t offset = (m_offset + align - 1) & ~(align - 1);
+            if (offset + size <= block.size)
+            {
+                m_offset = offset + size;
+                return block.data + offset;
+            }
+
+            m_current++;
+            m_offset = 0;
+        }
+    }
+
+    void reset()
+    {
+        m_current = 0;
+        m_offset = 0;
+    }
+
+    size_t blocks() const { return m_blocks.size(); }
+
+private:
+    struct Block
+    {
+        char *data;
+        size_t size;
+    };
+
+    std::vector<Block> m_blocks;
+    size_t m_block_size;
+    size_t m_current = 0;
+    size_t m_offset = 0;
+};
+
+// The arena new scratch allocates from on this thread, null means the heap
+inline Arena *&current_arena()
+{
+    static thread_local Arena *arena = nullptr;
+    return arena;
+}
+
+// Points this thread's scratch at an arena for the lifetime of the scope, then resets it.
+// Anything allocated inside must be gone by the end of the scope
+class ArenaScope
+{
+public:
+    explicit ArenaScope(Arena &arena) : m_arena(arena), m_previous(current_arena()) { current_arena() = &arena; }
+    ~ArenaScope()
+    {
+        current_arena() = m_previous;
+        m_arena.reset();
+    }
+    ArenaScope(const ArenaScope &) = delete;
+    ArenaScope &operator=(const ArenaScope &) = delete;
+
+private:
+    Arena &m_arena;
+    Arena *m_previous;
+};
+
+// Allocator that picks up the thread's current arena when it is created, and otherwise
+// uses the heap. Copies and assignments never take on another container's allocator, so
+// memory from an arena only leaves the scope if a container is move constructed out of it
+template <typename T>
+struct ArenaAllocator
+{
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::false_type;
+    using propagate_on_container_move_assignment = std::false_type;
+    using propagate_on_container_swap = std::false_type;
+
+    ArenaAllocator() : m_arena(current_arena()) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other) : m_arena(other.m_arena) {}
+
+    T *allocate(size_t n)
+    {
+        if (m_arena)
+            return (T *)m_arena->allocate(n * sizeof(T), alignof(T));
+        return (T *)::operator new(n * sizeof(T));
+    }
+
+    void deallocate(T *ptr, size_t)
+    {
+        if (!m_arena)
+            ::operator delete(ptr);
+    }
+
+    // A copy is scratch if it is made inside a scope, whatever the original was
+    ArenaAllocator select_on_container_copy_construction() const { return ArenaAllocator(); }
+
+    Arena *m_arena;
+};
+
+template <typename T, typename U>
+inline bool operator==(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) { return a.m_arena == b.m_arena; }
+template <typename T, typename U>
+inline bool operator!=(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) { return a.m_arena != b.m_arena; }
+
+#endif // ARENA_H
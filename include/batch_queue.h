@@ -0,0 +1,51 @@
+#ifndef BATCH_QUEUE_H
+#define BATCH_QUEUE_H
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+// A run of samples copied out of a Dataset into one contiguous block
+struct MiniBatch
+{
+    uint32_t size = 0; // The last batch of an epoch can be short
+    uint16_t features = 0;
+    std::vector<double> inputs;  // size x features, one sample after another
+    std::vector<uint8_t> labels; // Class index of each sample
+
+    inline const double *sample(uint32_t i) const { return &inputs[(size_t)i * features]; }
+};
+
+// Bounded lock-free MPMC ring of mini-batches, Vyukov style. Every slot owns its batch,
+// so producers assemble in place and once each slot has been filled nothing allocates.
+// Tickets are claimed in order and popped in the same order, so the sequence a consumer
+// sees never depends on which producer got to a batch first
+class BatchQueue
+{
+public:
+    BatchQueue(size_t capacity = 8);
+
+    // Claims the next ticket below `limit` as soon as its slot is free and points batch at
+    // the slot. Returns false once every ticket below limit has been claimed
+    bool begin_push(size_t limit, size_t &ticket, MiniBatch *&batch);
+    void end_push(size_t ticket);
+
+    // Waits for the next ticket to be published
+    MiniBatch &begin_pop(size_t &ticket);
+    void end_pop(size_t ticket);
+
+private:
+    struct Slot
+    {
+        std::atomic<size_t> sequence;
+        MiniBatch batch;
+    };
+
+    std::unique_ptr<Slot[]> m_slots; // Capacity is a power of two
+    size_t m_mask;
+    alignas(64) std::atomic<size_t> m_enqueue_pos;
+    alignas(64) std::atomic<size_t> m_dequeue_pos;
+};
+
+#endif // BATCH_QUEUE_H
@@ -0,0 +1,46 @@
+#ifndef DATASET_H
+#define DATASET_H
+
+#include "img.h"
+#include "numa_topology.h"
+#include <memory>
+#include <stdlib.h>
+#include <vector>
+
+// Immutable, pre-flattened copy of a set of images. Every sample starts on a
+// cache line so concurrent trainers can share one instance by const reference
+class Dataset
+{
+public:
+    Dataset(const std::vector<Img> &imgs);
+    // Replica of source on a NUMA node, so workers pinned there read local memory. Without
+    // libnuma the pages land on the node of the thread that builds the replica
+    Dataset(const Dataset &source, int node);
+    Dataset(const Dataset &) = delete;
+    Dataset &operator=(const Dataset &) = delete;
+
+    inline size_t size() const { return m_labels.size(); }
+    inline uint16_t features() const { return m_features; }
+    inline const double *sample(size_t i) const { return m_data.get() + i * m_stride; }
+    inline bool label(size_t i) const { return m_labels[i]; }
+
+private:
+    struct NodeDeleter
+    {
+        NodeDeleter() : size(0), node(-1) {}
+        NodeDeleter(size_t size, int node) : size(size), node(node) {}
+
+        size_t size;
+        int node;
+        void operator()(double *ptr) const { NumaTopology::get().free_on_node(ptr, size, node); }
+    };
+
+    void allocate(size_t n_samples, int node);
+
+    uint16_t m_features = 0;
+    size_t m_stride = 0; // Doubles between samples, rounded up to a whole cache line
+    std::unique_ptr<double[], NodeDeleter> m_data;
+    std::vector<bool> m_labels;
+};
+
+#endif // DATASET_H
@@ -0,0 +1,80 @@
+#ifndef FEATURE_CACHE_H
+#define FEATURE_CACHE_H
+
+#include <stdint.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Condensed images keyed by a hash of the PNG bytes mixed with a hash of the parameters
+// that produced them, so a frame is only processed again when its content or the
+// pipeline changes. The file is a header, a table of entries sorted by key and a blob of
+// pixels, mapped read only and searched in place. New entries are held in memory until
+// save() merges them into a fresh file
+class FeatureCache
+{
+public:
+    FeatureCache(const std::string &file_string);
+    ~FeatureCache();
+    FeatureCache(const FeatureCache &) = delete;
+    FeatureCache &operator=(const FeatureCache &) = delete;
+
+    static uint64_t hash(const void *data, size_t size, uint64_t seed = 0);
+    static uint64_t key(const void *data, size_t size, uint64_t params_hash) { return hash(data, size, params_hash); }
+
+    // Safe to call from any thread. Copies the pixels out so the caller never holds on to the mapping
+    bool find(uint64_t key, uint16_t &width, uint16_t &height, std::vector<uint8_t> &pixels);
+    void insert(uint64_t key, uint16_t width, uint16_t height, const uint8_t *pixels);
+
+    // Writes the mapped and new entries to a temporary file and renames it over the cache.
+    // Entries nobody looked up this run are dropped when keep_unused is false
+    bool save(bool keep_unused = true);
+
+    size_t size() const { return m_count + m_added.size(); }
+    size_t hits() const { return m_hits; }
+    size_t misses() const { return m_misses; }
+
+private:
+#pragma pack(push, 1)
+    struct Header
+    {
+        char magic[4]; // "NNFC"
+        uint32_t version;
+        uint64_t count;
+    };
+
+    struct Entry
+    {
+        uint64_t key;
+        uint32_t offset; // Into the pixel blob that follows the entry table
+        uint16_t width;
+        uint16_t height;
+    };
+#pragma pack(pop)
+
+    struct Added
+    {
+        Entry entry;
+        std::vector<uint8_t> pixels;
+    };
+
+    void map();
+    void unmap();
+
+    std::string m_file_string;
+    void *m_map = nullptr;
+    size_t m_map_size = 0;
+    const Entry *m_entries = nullptr;
+    const uint8_t *m_blob = nullptr;
+    size_t m_count = 0;
+
+    std::mutex m_mutex;
+    std::vector<bool> m_used;
+    std::vector<Added> m_added;
+    std::unordered_map<uint64_t, size_t> m_added_index;
+    size_t m_hits = 0;
+    size_t m_misses = 0;
+};
+
+#endif // FEATURE_CACHE_H
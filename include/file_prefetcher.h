@@ -0,0 +1,53 @@
+#ifndef FILE_PREFETCHER_H
+#define FILE_PREFETCHER_H
+
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct PrefetchedFile
+{
+    size_t index;               // Position of the file in the list given to the prefetcher
+    std::vector<uint8_t> *data; // Owned by the prefetcher, valid until release()
+    bool ok;                    // False if the file could not be opened or read
+};
+
+// Reads a list of files ahead of the decoders on `in_flight` I/O threads, so the per-file
+// latency of a network disk overlaps with decoding instead of adding to it. Reads land in
+// a fixed pool of buffers that consumers hand back with release(), which caps memory and
+// lets the buffers keep their capacity from one file to the next. Files come out in the
+// order their reads finish, any number of consumer threads may call next()
+class FilePrefetcher
+{
+public:
+    FilePrefetcher(const std::vector<std::string> &file_names, unsigned in_flight = 8, size_t buffers = 0);
+    ~FilePrefetcher();
+
+    // Blocks until a read completes, returns false once every file has been handed out
+    bool next(PrefetchedFile &file);
+    void release(PrefetchedFile &file);
+
+private:
+    static bool read_file(const std::string &file_name, std::vector<uint8_t> &data);
+    void reader_loop();
+
+    const std::vector<std::string> &m_file_names;
+    std::vector<std::unique_ptr<std::vector<uint8_t>>> m_buffers;
+    std::vector<std::vector<uint8_t> *> m_free_buffers;
+    std::deque<PrefetchedFile> m_ready;
+    size_t m_next_file = 0;
+    size_t m_handed_out = 0;
+    bool m_stopping = false;
+
+    std::mutex m_mutex;
+    std::condition_variable m_buffer_freed;
+    std::condition_variable m_file_ready;
+    std::vector<std::thread> m_readers;
+};
+
+#endif // FILE_PREFETCHER_H
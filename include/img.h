@@ -14,4 +14,10 @@ struct Img
 
 std::vector<Img> load_csv(const char *_file_name);
 
+// Binary round trip of a set of images, load_imgs returns an empty set if the file is missing or damaged
+bool save_imgs(const std::vector<Img> &_imgs, const char *_file_name);
+std::vector<Img> load_imgs(const char *_file_name);
+Matrix stack_imgs(const std::vector<Img> &_imgs);
+std::vector<bool> stack_labels(const std::vector<Img> &_imgs);
+
 #endif // IMG_H
\ No newline at end of file
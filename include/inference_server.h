@@ -0,0 +1,179 @@
+#ifndef INFERENCE_SERVER_H
+#define INFERENCE_SERVER_H
+
+#include <stdint.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "shm_ring.h"
+#include "static_network.h"
+
+using deployed_network_t = StaticNetwork<64, 200, 2>;
+
+enum InferenceFormat : uint8_t
+{
+    RawPixels = 0, // 64 condensed 8x8 pixels, 0-255, row by row
+    PngFrame = 1   // A camera frame, condensed by the server
+};
+
+enum InferenceStatus : uint8_t
+{
+    InferenceOk = 0,
+    BadRequest = 1,
+    DecodeFailed = 2,
+    Unsupported = 3 // PNG sent to a server started without a decoder
+};
+
+// Every request is a header followed by `size` payload bytes, every response is a single
+// InferenceResponse. Fields are little endian. Responses on one connection come back in
+// the order their batches finish, so clients match them up by id
+#pragma pack(push, 1)
+struct InferenceRequestHeader
+{
+    uint32_t id;
+    uint8_t format;
+    uint32_t size;
+};
+
+struct InferenceResponse
+{
+    uint32_t id;
+    uint8_t status;
+    uint8_t label;  // 1 for a good part
+    float score;    // Output of the good part node
+};
+#pragma pack(pop)
+
+struct ServerConfig
+{
+    std::string socket_path;
+    uint32_t max_batch = 64;        // Samples scored per wakeup of the batcher
+    uint32_t max_delay_us = 1000;   // Longest the first request of a batch waits for company
+    uint32_t max_payload = 1 << 24; // Larger requests close the connection
+    unsigned decoders = 2;          // Threads condensing PNG requests
+};
+
+// Serves one loaded network to any number of clients on a Unix stream socket. A single
+// epoll thread owns every connection and only parses and writes, requests go to a batcher
+// that waits up to max_delay_us for more to arrive and scores them together, and PNG
+// frames are condensed on their own threads first so decoding never holds up a batch
+class InferenceServer
+{
+public:
+    // Condenses a PNG into 64 pixels as preprocessing does, called from several threads at once
+    using png_decoder_t = std::function<bool(const std::vector<uint8_t> &png, uint8_t *pixels)>;
+
+    InferenceServer(const deployed_network_t &net, const ServerConfig &config, png_decoder_t png_decoder = nullptr);
+    ~InferenceServer();
+    InferenceServer(const InferenceServer &) = delete;
+    InferenceServer &operator=(const InferenceServer &) = delete;
+
+    // Binds the socket and starts the worker threads, false if the socket could not be set up
+    bool start();
+    // Handles connections until stop(), then shuts the workers down
+    void run();
+    // Safe to call from a signal handler
+    void stop();
+
+    size_t requests() const { return m_requests; }
+    size_t batches() const { return m_batches; }
+
+    static InferenceResponse classify(const deployed_network_t &net, uint32_t id, const uint8_t *pixels);
+
+private:
+    using clock_t = std::chrono::steady_clock;
+
+    struct Job
+    {
+        uint64_t connection;
+        uint32_t id;
+        clock_t::time_point arrival;
+        std::array<uint8_t, 64> pixels;
+        std::vector<uint8_t> png;
+    };
+
+    struct Reply
+    {
+        uint64_t connection;
+        InferenceResponse response;
+    };
+
+    struct Connection
+    {
+        int fd;
+        std::vector<uint8_t> in;
+        std::vector<uint8_t> out;
+        bool writing = false;     // Waiting on EPOLLOUT for a full socket buffer to drain
+        bool read_closed = false; // The client shut down its sending side and waits for its replies
+        uint32_t in_flight = 0;   // Requests queued for the workers and not answered yet
+    };
+
+    void accept_connections();
+    bool read_connection(uint64_t id, Connection &connection);
+    bool parse_requests(uint64_t id, Connection &connection);
+    void send_reply(Connection &connection, const InferenceResponse &response);
+    bool flush_connection(uint64_t id, Connection &connection);
+    // A half closed connection is done once every request it sent is answered and sent
+    bool finished(const Connection &connection) const { return connection.read_closed && !connection.in_flight && connection.out.empty(); }
+    void close_connection(uint64_t id);
+    void deliver_replies();
+    void post_replies(std::vector<Reply> &replies);
+
+    void batcher_loop();
+    void decoder_loop();
+
+    const deployed_network_t &m_net;
+    ServerConfig m_config;
+    png_decoder_t m_png_decoder;
+
+    int m_listen_fd = -1;
+    int m_epoll_fd = -1;
+    int m_event_fd = -1;
+    std::atomic<bool> m_stopping;
+    std::unordered_map<uint64_t, Connection> m_connections;
+    uint64_t m_next_connection = 2; // 0 and 1 tag the listening socket and the eventfd
+
+    std::mutex m_mutex;
+    std::condition_variable m_batch_ready;
+    std::condition_variable m_decode_ready;
+    std::deque<Job> m_pending;
+    std::deque<Job> m_decode_jobs;
+    bool m_shutdown = false;
+
+    std::mutex m_reply_mutex;
+    std::vector<Reply> m_replies;
+
+    std::atomic<size_t> m_requests;
+    std::atomic<size_t> m_batches;
+    std::vector<std::thread> m_workers;
+};
+
+// The same service over a pair of ShmRings for a station on the same box. Frames are
+// classified in place in the frame ring and each answer is written straight into the next
+// slot of the result ring, which carries one InferenceResponse per slot
+class ShmClassifier
+{
+public:
+    ShmClassifier(const deployed_network_t &net, ShmRing &frames, ShmRing &results, InferenceServer::png_decoder_t png_decoder = nullptr);
+
+    // Serves frames until either ring is interrupted
+    void run();
+    size_t frames() const { return m_frames; }
+
+private:
+    const deployed_network_t &m_net;
+    ShmRing &m_frame_ring;
+    ShmRing &m_result_ring;
+    InferenceServer::png_decoder_t m_png_decoder;
+    std::atomic<size_t> m_frames;
+};
+
+#endif // INFERENCE_SERVER_H
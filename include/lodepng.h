@@ -1,8 +1,12 @@
 #pragma once
 
+#include <algorithm>
+#include <utility>
 #include <vector>
+#include <stddef.h>
+#include <stdint.h>
 
-int decodePNG(std::vector<unsigned char> &out_image, uint16_t &image_width, uint16_t &image_height, const unsigned char *in_png, size_t in_size, bool convert_to_rgba32 = true)
+namespace lodepng
 {
 	static const unsigned long LENBASE[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
 	static const unsigned long LENEXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
@@ -12,21 +16,58 @@ int decodePNG(std::vector<unsigned char> &out_image, uint16_t &image_width, uint
 
 	struct Zlib // nested functions for zlib decompression
 	{
-
-		static unsigned long readBitFromStream(size_t &bitp, const unsigned char *bits)
-		{
-			unsigned long result = (bits[bitp >> 3] >> (bitp & 0x7)) & 1;
-			bitp++;
-			return result;
-		}
-
-		static unsigned long readBitsFromStream(size_t &bitp, const unsigned char *bits, size_t nbits)
+		struct BitReader // reads the deflate bit stream straight out of the IDAT chunks, without joining them first
 		{
-			unsigned long result = 0;
-			for (size_t i = 0; i < nbits; i++)
-				result += (readBitFromStream(bitp, bits)) << i;
-			return result;
-		}
+			std::vector<std::pair<const unsigned char *, size_t>> segments;
+			size_t segment, byte;
+			uint64_t buffer; // bits not consumed yet, least significant first
+			unsigned long count;
+			bool overrun; // set once a read went past the last segment
+			void reset()
+			{
+				segment = byte = 0;
+				buffer = 0;
+				count = 0;
+				overrun = false;
+			}
+			void refill()
+			{
+				while (count <= 56)
+				{
+					while (segment < segments.size() && byte >= segments[segment].second)
+					{
+						segment++;
+						byte = 0;
+					}
+					if (segment >= segments.size())
+						return;
+					buffer |= (uint64_t)segments[segment].first[byte++] << count;
+					count += 8;
+				}
+			}
+			unsigned long readBits(unsigned long nbits)
+			{
+				if (count < nbits)
+				{
+					refill();
+					if (count < nbits)
+					{
+						overrun = true;
+						return 0;
+					}
+				}
+				unsigned long result = (unsigned long)(buffer & ((1ULL << nbits) - 1));
+				buffer >>= nbits;
+				count -= nbits;
+				return result;
+			}
+			unsigned long readBit() { return readBits(1); }
+			void alignToByte()
+			{
+				buffer >>= (count & 7);
+				count -= (count & 7);
+			}
+		};
 
 		struct HuffmanTree
 		{
@@ -34,7 +75,9 @@ int decodePNG(std::vector<unsigned char> &out_image, uint16_t &image_width, uint
 			int makeFromLengths(const std::vector<unsigned long> &bitlen, unsigned long maxbitlen)
 			{
 				unsigned long numcodes = (unsigned long)(bitlen.size()), treepos = 0, nodefilled = 0;
-				std::vector<unsigned long> tree1d(numcodes), blcount(maxbitlen + 1, 0), nextcode(maxbitlen + 1, 0);
+				tree1d.assign(numcodes, 0);
+				blcount.assign(maxbitlen + 1, 0);
+				nextcode.assign(maxbitlen + 1, 0);
 				for (unsigned long bits = 0; bits < numcodes; bits++)
 					blcount[bitlen[bits]]++; // count number of instances of each code length
 				for (unsigned long bits = 1; bits <= maxbitlen; bits++)
@@ -82,44 +125,107 @@ int decodePNG(std::vector<unsigned char> &out_image, uint16_t &image_width, uint
 				return 0;
 			}
 
-			std::vector<unsigned long> tree2d; // 2D representation of a huffman tree: The one dimension is "0" or "1", the other contains all nodes and leaves of the tree.
+			std::vector<unsigned long> tree2d;					  // 2D representation of a huffman tree: The one dimension is "0" or "1", the other contains all nodes and leaves of the tree.
+			std::vector<unsigned long> tree1d, blcount, nextcode; // scratch for makeFromLengths, kept so rebuilding a tree doesn't allocate
 		};
 
+		// Inflates into a ring buffer that only ever holds the last window of output. Work happens
+		// one symbol at a time, so inflateTo() can stop as soon as enough bytes exist and carry on
+		// from the same place on the next call
 		struct Inflator
 		{
 			int error;
-			void inflate(std::vector<unsigned char> &out, const std::vector<unsigned char> &in, size_t inpos = 0)
+			BitReader in;
+			HuffmanTree codetree, codetreeD, codelengthcodetree; // the code tree for Huffman codes, dist codes, and code length codes
+			HuffmanTree fixedtree, fixedtreeD;					 // built on the first fixed block and kept for the life of the inflator
+			const HuffmanTree *literals, *distances;			 // the trees of the current block
+			std::vector<unsigned long> bitlen, bitlenD, codelengthcode;
+			bool fixedBuilt = false;
+			std::vector<unsigned char> window;
+			size_t mask, pos; // pos counts every byte produced so far
+			bool inBlock, finalBlock, done;
+			unsigned long btype;
+			size_t storedLeft;
+			int start(size_t windowSize) // returns error value
 			{
-				size_t bp = 0, pos = 0; // bit pointer and byte pointer
+				size_t size = 1;
+				while (size < windowSize + 32768 + 258)
+					size <<= 1;
+				window.resize(size);
+				mask = size - 1;
+				pos = 0;
+				inBlock = finalBlock = done = false;
 				error = 0;
-				unsigned long BFINAL = 0;
-				while (!BFINAL && !error)
+				in.reset();
+				unsigned long CMF = in.readBits(8), FLG = in.readBits(8);
+				if (in.overrun)
+					return 53; // error, size of zlib data too small
+				if ((CMF * 256 + FLG) % 31 != 0)
+					return 24; // error: 256 * in[0] + in[1] must be a multiple of 31, the FCHECK value is supposed to be made that way
+				unsigned long CM = CMF & 15, CINFO = (CMF >> 4) & 15, FDICT = (FLG >> 5) & 1;
+				if (CM != 8 || CINFO > 7)
+					return 25; // error: only compression method 8: inflate with sliding window of 32k is supported by the PNG spec
+				if (FDICT != 0)
+					return 26; // error: the specification of PNG says about the zlib stream: "The additional flags shall not specify a preset dictionary."
+				return 0;
+			}
+			void inflateTo(size_t target) // note: adler32 checksum is skipped and ignored
+			{
+				while (pos < target && !done && !error)
 				{
-					if (bp >> 3 >= in.size())
+					if (!inBlock)
 					{
-						error = 52;
-						return;
-					} // error, bit pointer will jump past memory
-					BFINAL = readBitFromStream(bp, &in[inpos]);
-					unsigned long BTYPE = readBitFromStream(bp, &in[inpos]);
-					BTYPE += 2 * readBitFromStream(bp, &in[inpos]);
-					if (BTYPE == 3)
-					{
-						error = 20;
-						return;
-					} // error: invalid BTYPE
-					else if (BTYPE == 0)
-						inflateNoCompression(out, &in[inpos], bp, pos, in.size());
+						if (finalBlock)
+						{
+							done = true;
+							return;
+						}
+						finalBlock = in.readBit();
+						btype = in.readBit();
+						btype += 2 * in.readBit();
+						if (in.overrun)
+						{
+							error = 52;
+							return;
+						} // error, bit pointer will jump past memory
+						if (btype == 3)
+						{
+							error = 20;
+							return;
+						} // error: invalid BTYPE
+						else if (btype == 0)
+							startNoCompression();
+						else if (btype == 1)
+						{
+							if (!fixedBuilt)
+								generateFixedTrees(fixedtree, fixedtreeD);
+							fixedBuilt = true;
+							literals = &fixedtree;
+							distances = &fixedtreeD;
+						}
+						else
+						{
+							getTreeInflateDynamic(codetree, codetreeD);
+							literals = &codetree;
+							distances = &codetreeD;
+						}
+						inBlock = !error;
+					}
+					else if (btype == 0)
+						inflateNoCompression(target);
 					else
-						inflateHuffmanBlock(out, &in[inpos], bp, pos, in.size(), BTYPE);
+						inflateHuffmanSymbol();
 				}
-				if (!error)
-					out.resize(pos); // Only now we know the true size of out, resize it to that
+			}
+			void copy(unsigned char *out, size_t from, size_t length) const // copy produced bytes [from, from + length) out of the window
+			{
+				for (size_t i = 0; i < length; i++)
+					out[i] = window[(from + i) & mask];
 			}
 			void generateFixedTrees(HuffmanTree &tree, HuffmanTree &treeD) // get the tree of a deflated block with fixed tree
 			{
-				std::vector<unsigned long> bitlen(288, 8), bitlenD(32, 5);
-				;
+				bitlen.assign(288, 8);
+				bitlenD.assign(32, 5);
 				for (size_t i = 144; i <= 255; i++)
 					bitlen[i] = 9;
 				for (size_t i = 256; i <= 279; i++)
@@ -127,46 +233,52 @@ int decodePNG(std::vector<unsigned char> &out_image, uint16_t &image_width, uint
 				tree.makeFromLengths(bitlen, 15);
 				treeD.makeFromLengths(bitlenD, 15);
 			}
-			HuffmanTree codetree, codetreeD, codelengthcodetree; // the code tree for Huffman codes, dist codes, and code length codes
-			unsigned long huffmanDecodeSymbol(const unsigned char *in, size_t &bp, const HuffmanTree &codetree, size_t inlength)
+			unsigned long huffmanDecodeSymbol(const HuffmanTree &codetree)
 			{ // decode a single symbol from given list of bits with given code tree. return value is the symbol
 				bool decoded;
 				unsigned long ct;
+				if (in.count < 15)
+					in.refill(); // codes are at most 15 bits, so the walk below only checks for the end of the data
 				for (size_t treepos = 0;;)
 				{
-					if ((bp & 0x07) == 0 && (bp >> 3) > inlength)
+					if (in.count == 0)
 					{
+						in.overrun = true;
 						error = 10;
 						return 0;
 					} // error: end reached without endcode
-					error = codetree.decode(decoded, ct, treepos, readBitFromStream(bp, in));
+					unsigned long bit = (unsigned long)(in.buffer & 1);
+					in.buffer >>= 1;
+					in.count--;
+					error = codetree.decode(decoded, ct, treepos, bit);
 					if (error)
 						return 0; // stop, an error happened
 					if (decoded)
 						return ct;
 				}
 			}
-			void getTreeInflateDynamic(HuffmanTree &tree, HuffmanTree &treeD, const unsigned char *in, size_t &bp, size_t inlength)
+			void getTreeInflateDynamic(HuffmanTree &tree, HuffmanTree &treeD)
 			{ // get the tree of a deflated block with dynamic tree, the tree itself is also Huffman compressed with a known tree
-				std::vector<unsigned long> bitlen(288, 0), bitlenD(32, 0);
-				if (bp >> 3 >= inlength - 2)
+				bitlen.assign(288, 0);
+				bitlenD.assign(32, 0);
+				size_t HLIT = in.readBits(5) + 257;			   // number of literal/length codes + 257
+				size_t HDIST = in.readBits(5) + 1;			   // number of dist codes + 1
+				size_t HCLEN = in.readBits(4) + 4;			   // number of code length codes + 4
+				codelengthcode.resize(19); // lengths of tree to decode the lengths of the dynamic tree
+				for (size_t i = 0; i < 19; i++)
+					codelengthcode[CLCL[i]] = (i < HCLEN) ? in.readBits(3) : 0;
+				if (in.overrun)
 				{
 					error = 49;
 					return;
-				}												   // the bit pointer is or will go past the memory
-				size_t HLIT = readBitsFromStream(bp, in, 5) + 257; // number of literal/length codes + 257
-				size_t HDIST = readBitsFromStream(bp, in, 5) + 1;  // number of dist codes + 1
-				size_t HCLEN = readBitsFromStream(bp, in, 4) + 4;  // number of code length codes + 4
-				std::vector<unsigned long> codelengthcode(19);	   // lengths of tree to decode the lengths of the dynamic tree
-				for (size_t i = 0; i < 19; i++)
-					codelengthcode[CLCL[i]] = (i < HCLEN) ? readBitsFromStream(bp, in, 3) : 0;
+				} // the bit pointer is or will go past the memory
 				error = codelengthcodetree.makeFromLengths(codelengthcode, 7);
 				if (error)
 					return;
 				size_t i = 0, replength;
 				while (i < HLIT + HDIST)
 				{
-					unsigned long code = huffmanDecodeSymbol(in, bp, codelengthcodetree, inlength);
+					unsigned long code = huffmanDecodeSymbol(codelengthcodetree);
 					if (error)
 						return;
 					if (code <= 15)
@@ -178,12 +290,12 @@ int decodePNG(std::vector<unsigned char> &out_image, uint16_t &image_width, uint
 					}					 // a length code
 					else if (code == 16) // repeat previous
 					{
-						if (bp >> 3 >= inlength)
+						replength = 3 + in.readBits(2);
+						if (in.overrun || i == 0)
 						{
 							error = 50;
 							return;
 						} // error, bit pointer jumps past memory
-						replength = 3 + readBitsFromStream(bp, in, 2);
 						unsigned long value; // set value to the previous code
 						if ((i - 1) < HLIT)
 							value = bitlen[i - 1];
@@ -202,40 +314,19 @@ int decodePNG(std::vector<unsigned char> &out_image, uint16_t &image_width, uint
 								bitlenD[i++ - HLIT] = value;
 						}
 					}
-					else if (code == 17) // repeat "0" 3-10 times
+					else if (code == 17 || code == 18) // repeat "0" 3-10 times or 11-138 times
 					{
-						if (bp >> 3 >= inlength)
+						replength = code == 17 ? 3 + in.readBits(3) : 11 + in.readBits(7);
+						if (in.overrun)
 						{
 							error = 50;
 							return;
 						} // error, bit pointer jumps past memory
-						replength = 3 + readBitsFromStream(bp, in, 3);
 						for (size_t n = 0; n < replength; n++) // repeat this value in the next lengths
 						{
 							if (i >= HLIT + HDIST)
 							{
-								error = 14;
-								return;
-							} // error: i is larger than the amount of codes
-							if (i < HLIT)
-								bitlen[i++] = 0;
-							else
-								bitlenD[i++ - HLIT] = 0;
-						}
-					}
-					else if (code == 18) // repeat "0" 11-138 times
-					{
-						if (bp >> 3 >= inlength)
-						{
-							error = 50;
-							return;
-						} // error, bit pointer jumps past memory
-						replength = 11 + readBitsFromStream(bp, in, 7);
-						for (size_t n = 0; n < replength; n++) // repeat this value in the next lengths
-						{
-							if (i >= HLIT + HDIST)
-							{
-								error = 15;
+								error = code == 17 ? 14 : 15;
 								return;
 							} // error: i is larger than the amount of codes
 							if (i < HLIT)
@@ -259,122 +350,75 @@ int decodePNG(std::vector<unsigned char> &out_image, uint16_t &image_width, uint
 				if (error)
 					return; // now we've finally got HLIT and HDIST, so generate the code trees, and the function is done
 				error = treeD.makeFromLengths(bitlenD, 15);
-				if (error)
-					return;
 			}
-			void inflateHuffmanBlock(std::vector<unsigned char> &out, const unsigned char *in, size_t &bp, size_t &pos, size_t inlength, unsigned long btype)
+			void inflateHuffmanSymbol()
 			{
-				if (btype == 1)
-				{
-					generateFixedTrees(codetree, codetreeD);
-				}
-				else if (btype == 2)
-				{
-					getTreeInflateDynamic(codetree, codetreeD, in, bp, inlength);
+				unsigned long code = huffmanDecodeSymbol(*literals);
+				if (error)
+					return;
+				if (code == 256)
+					inBlock = false;  // end code
+				else if (code <= 255) // literal symbol
+					window[pos++ & mask] = (unsigned char)(code);
+				else if (code >= 257 && code <= 285) // length code
+				{
+					size_t length = LENBASE[code - 257] + in.readBits(LENEXTRA[code - 257]);
+					unsigned long codeD = huffmanDecodeSymbol(*distances);
 					if (error)
 						return;
-				}
-				for (;;)
-				{
-					unsigned long code = huffmanDecodeSymbol(in, bp, codetree, inlength);
-					if (error)
+					if (codeD > 29)
+					{
+						error = 18;
 						return;
-					if (code == 256)
-						return;			  // end code
-					else if (code <= 255) // literal symbol
+					} // error: invalid dist code (30-31 are never used)
+					size_t dist = DISTBASE[codeD] + in.readBits(DISTEXTRA[codeD]);
+					if (in.overrun)
 					{
-						if (pos >= out.size())
-							out.resize((pos + 1) * 2); // reserve more room
-						out[pos++] = (unsigned char)(code);
-					}
-					else if (code >= 257 && code <= 285) // length code
+						error = 51;
+						return;
+					} // error, bit pointer will jump past memory
+					if (dist > pos)
 					{
-						size_t length = LENBASE[code - 257], numextrabits = LENEXTRA[code - 257];
-						if ((bp >> 3) >= inlength)
-						{
-							error = 51;
-							return;
-						} // error, bit pointer will jump past memory
-						length += readBitsFromStream(bp, in, numextrabits);
-						unsigned long codeD = huffmanDecodeSymbol(in, bp, codetreeD, inlength);
-						if (error)
-							return;
-						if (codeD > 29)
-						{
-							error = 18;
-							return;
-						} // error: invalid dist code (30-31 are never used)
-						unsigned long dist = DISTBASE[codeD], numextrabitsD = DISTEXTRA[codeD];
-						if ((bp >> 3) >= inlength)
-						{
-							error = 51;
-							return;
-						} // error, bit pointer will jump past memory
-						dist += readBitsFromStream(bp, in, numextrabitsD);
-						size_t start = pos, back = start - dist; // backwards
-						if (pos + length >= out.size())
-							out.resize((pos + length) * 2); // reserve more room
-						for (size_t i = 0; i < length; i++)
-						{
-							out[pos++] = out[back++];
-							if (back >= start)
-								back = start - dist;
-						}
-					}
+						error = 52;
+						return;
+					} // error: distance reaches back before the start of the output
+					for (size_t i = 0; i < length; i++, pos++)
+						window[pos & mask] = window[(pos - dist) & mask];
 				}
+				else
+					error = 16;
 			}
-			void inflateNoCompression(std::vector<unsigned char> &out, const unsigned char *in, size_t &bp, size_t &pos, size_t inlength)
+			void startNoCompression()
 			{
-				while ((bp & 0x7) != 0)
-					bp++; // go to first boundary of byte
-				size_t p = bp / 8;
-				if (p >= inlength - 4)
+				in.alignToByte();
+				unsigned long LEN = in.readBits(16), NLEN = in.readBits(16);
+				if (in.overrun)
 				{
 					error = 52;
 					return;
 				} // error, bit pointer will jump past memory
-				unsigned long LEN = in[p] + 256 * in[p + 1], NLEN = in[p + 2] + 256 * in[p + 3];
-				p += 4;
 				if (LEN + NLEN != 65535)
 				{
 					error = 21;
 					return;
 				} // error: NLEN is not one's complement of LEN
-				if (pos + LEN >= out.size())
-					out.resize(pos + LEN);
-				if (p + LEN > inlength)
+				storedLeft = LEN;
+			}
+			void inflateNoCompression(size_t target)
+			{
+				for (; storedLeft > 0 && pos < target; storedLeft--)
 				{
-					error = 23;
-					return;
-				} // error: reading outside of in buffer
-				for (unsigned long n = 0; n < LEN; n++)
-					out[pos++] = in[p++]; // read LEN bytes of literal data
-				bp = p * 8;
+					window[pos++ & mask] = (unsigned char)in.readBits(8); // read LEN bytes of literal data
+					if (in.overrun)
+					{
+						error = 23;
+						return;
+					} // error: reading outside of in buffer
+				}
+				if (storedLeft == 0)
+					inBlock = false;
 			}
 		};
-		int decompress(std::vector<unsigned char> &out, const std::vector<unsigned char> &in) // returns error value
-		{
-			Inflator inflator;
-			if (in.size() < 2)
-			{
-				return 53;
-			} // error, size of zlib data too small
-			if ((in[0] * 256 + in[1]) % 31 != 0)
-			{
-				return 24;
-			} // error: 256 * in[0] + in[1] must be a multiple of 31, the FCHECK value is supposed to be made that way
-			unsigned long CM = in[0] & 15, CINFO = (in[0] >> 4) & 15, FDICT = (in[1] >> 5) & 1;
-			if (CM != 8 || CINFO > 7)
-			{
-				return 25;
-			} // error: only compression method 8: inflate with sliding window of 32k is supported by the PNG spec
-			if (FDICT != 0)
-			{
-				return 26;
-			} // error: the specification of PNG says about the zlib stream: "The additional flags shall not specify a preset dictionary."
-			inflator.inflate(out, in, 2);
-			return inflator.error; // note: adler32 checksum was skipped and ignored
-		}
 	};
 	struct PNG // nested functions for PNG decoding
 	{
@@ -385,7 +429,18 @@ int decodePNG(std::vector<unsigned char> &out_image, uint16_t &image_width, uint
 			std::vector<unsigned char> palette;
 		} info;
 		int error;
+		Zlib::Inflator inflator;					   // reads the IDAT chunks in place, so the png buffer must outlive the decoder
+		std::vector<unsigned char> prevline, curline; // the last two unfiltered scanlines
+		std::vector<unsigned char> wrapped;           // a scanline split by the end of the inflate window
+		size_t nextRow;								   // index of the next scanline nextScanline() returns
 		void decode(std::vector<unsigned char> &out, const unsigned char *in, size_t size, bool convert_to_rgba32)
+		{
+			open(in, size);
+			if (error)
+				return;
+			decodeOpened(out, convert_to_rgba32);
+		}
+		void open(const unsigned char *in, size_t size) // read the chunks and get ready to inflate, nothing is decompressed yet
 		{
 			error = 0;
 			if (size == 0 || in == 0)
@@ -396,10 +451,11 @@ int decodePNG(std::vector<unsigned char> &out_image, uint16_t &image_width, uint
 			readPngHeader(&in[0], size);
 			if (error)
 				return;
-			size_t pos = 33;				 // first byte of the first chunk after the header
-			std::vector<unsigned char> idat; // the data from idat chunks
+			size_t pos = 33; // first byte of the first chunk after the header
+			inflator.in.segments.clear();
 			bool IEND = false, known_type = true;
 			info.key_defined = false;
+			info.palette.clear();
 			while (!IEND) // loop through the chunks, ignoring unknown chunks and stopping at IEND chunk. IDAT data is put at the start of the in buffer
 			{
 				if (pos + 8 >= size)
@@ -421,7 +477,7 @@ int decodePNG(std::vector<unsigned char> &out_image, uint16_t &image_width, uint
 				}																						  // error: size of the in buffer too small to contain next chunk
 				if (in[pos + 0] == 'I' && in[pos + 1] == 'D' && in[pos + 2] == 'A' && in[pos + 3] == 'T') // IDAT chunk, containing compressed image data
 				{
-					idat.insert(idat.end(), &in[pos + 4], &in[pos + 4 + chunkLength]);
+					inflator.in.segments.push_back(std::make_pair(&in[pos + 4], chunkLength));
 					pos += (4 + chunkLength);
 				}
 				else if (in[pos + 0] == 'I' && in[pos + 1] == 'E' && in[pos + 2] == 'N' && in[pos + 3] == 'D')
@@ -502,42 +558,73 @@ int decodePNG(std::vector<unsigned char> &out_image, uint16_t &image_width, uint
 				}
 				pos += 4; // step over CRC (which is ignored)
 			}
+			startStream();
+		}
+		size_t lineLength() { return (info.width * getBpp(info) + 7) / 8; } // length in bytes of a scanline, excluding the filtertype byte
+		void startStream() // (re)start inflating from the first scanline
+		{
+			size_t linelength = lineLength();
+			error = inflator.start(linelength + 1);
+			prevline.assign(linelength, 0);
+			curline.assign(linelength, 0);
+			nextRow = 0;
+		}
+		bool inflateTo(size_t length) // make sure the first length bytes of the image data have been produced
+		{
+			inflator.inflateTo(length);
+			if (inflator.error)
+				error = inflator.error;
+			else if (inflator.pos < length)
+				error = 88; // error: the zlib stream ended before the last scanline
+			return !error;
+		}
+		const unsigned char *nextScanline() // inflate and unfilter one more row of a non interlaced image, 0 on error
+		{
+			curline.swap(prevline);
+			return nextScanlineInto(curline.empty() ? 0 : &curline[0], prevline.empty() ? 0 : &prevline[0]);
+		}
+		const unsigned char *nextScanlineInto(unsigned char *out, const unsigned char *prev) // nextScanline unfiltering into out, with prev the row it returned last, so rows can go straight into a whole frame
+		{
+			size_t linelength = curline.size(), start = nextRow * (linelength + 1);
+			if (!inflateTo(start + linelength + 1))
+				return 0;
+			const unsigned char *scanline = &inflator.window[start & inflator.mask];
+			if ((start & inflator.mask) + linelength + 1 > inflator.window.size()) // row wraps around the end of the window
+			{
+				wrapped.resize(linelength + 1);
+				inflator.copy(&wrapped[0], start, linelength + 1);
+				scanline = &wrapped[0];
+			}
+			if (linelength)
+				unFilterScanline(out, scanline + 1, nextRow == 0 ? 0 : prev, (getBpp(info) + 7) / 8, scanline[0], linelength);
+			nextRow++;
+			return error ? 0 : (linelength ? out : scanline);
+		}
+		void decodeOpened(std::vector<unsigned char> &out, bool convert_to_rgba32)
+		{
 			unsigned long bpp = getBpp(info);
-			std::vector<unsigned char> scanlines(((info.width * (info.height * bpp + 7)) / 8) + info.height); // now the out buffer will be filled
-			Zlib zlib;																						  // decompress with the Zlib decompressor
-			error = zlib.decompress(scanlines, idat);
-			if (error)
-				return; // stop if the zlib decompressor returned an error
 			size_t bytewidth = (bpp + 7) / 8, outlength = (info.height * info.width * bpp + 7) / 8;
-			out.resize(outlength);						   // time to fill the out buffer
+			out.resize(outlength); // time to fill the out buffer
+			if (bpp < 8)
+				std::fill(out.begin(), out.end(), 0); // packed pixels are ORed in, and out may be a reused buffer
 			unsigned char *out_ = outlength ? &out[0] : 0; // use a regular pointer to the std::vector for faster code if compiled without optimization
-			if (info.interlaceMethod == 0)				   // no interlace, just filter
+			if (nextRow != 0)
+				startStream(); // scanlines were read before, the stream only runs forward
+			if (error)
+				return;
+			if (info.interlaceMethod == 0) // no interlace, just filter
 			{
-				size_t linestart = 0, linelength = (info.width * bpp + 7) / 8; // length in bytes of a scanline, excluding the filtertype byte
-				if (bpp >= 8)												   // byte per byte
-					for (unsigned long y = 0; y < info.height; y++)
-					{
-						unsigned long filterType = scanlines[linestart];
-						const unsigned char *prevline = (y == 0) ? 0 : &out_[(y - 1) * info.width * bytewidth];
-						unFilterScanline(&out_[linestart - y], &scanlines[linestart + 1], prevline, bytewidth, filterType, linelength);
-						if (error)
-							return;
-						linestart += (1 + linelength); // go to start of next scanline
-					}
-				else // less than 8 bits per pixel, so fill it up bit per bit
+				size_t linelength = lineLength();
+				for (size_t y = 0, obp = 0; y < info.height; y++)
 				{
-					std::vector<unsigned char> templine((info.width * bpp + 7) >> 3); // only used if bpp < 8
-					for (size_t y = 0, obp = 0; y < info.height; y++)
-					{
-						unsigned long filterType = scanlines[linestart];
-						const unsigned char *prevline = (y == 0) ? 0 : &out_[(y - 1) * info.width * bytewidth];
-						unFilterScanline(&templine[0], &scanlines[linestart + 1], prevline, bytewidth, filterType, linelength);
-						if (error)
-							return;
+					const unsigned char *line = nextScanline();
+					if (!line)
+						return;
+					if (bpp >= 8) // byte per byte
+						std::copy(line, line + linelength, &out_[y * info.width * bytewidth]);
+					else // less than 8 bits per pixel, so fill it up bit per bit
 						for (size_t bp = 0; bp < info.width * bpp;)
-							setBitOfReversedStream(obp, out_, readBitFromReversedStream(bp, &templine[0]));
-						linestart += (1 + linelength); // go to start of next scanline
-					}
+							setBitOfReversedStream(obp, out_, readBitFromReversedStream(bp, line));
 				}
 			}
 			else // interlaceMethod is 1 (Adam7)
@@ -548,6 +635,16 @@ int decodePNG(std::vector<unsigned char> &out_image, uint16_t &image_width, uint
 				size_t pattern[28] = {0, 4, 0, 2, 0, 1, 0, 0, 0, 4, 0, 2, 0, 1, 8, 8, 4, 4, 2, 2, 1, 8, 8, 8, 4, 4, 2, 2}; // values for the adam7 passes
 				for (int i = 0; i < 6; i++)
 					passstart[i + 1] = passstart[i] + passh[i] * ((passw[i] ? 1 : 0) + (passw[i] * bpp + 7) / 8);
+				size_t total = passstart[6] + passh[6] * ((passw[6] ? 1 : 0) + (passw[6] * bpp + 7) / 8);
+				std::vector<unsigned char> scanlines(total); // adam7Pass works on whole passes, so interlaced images are still inflated in full
+				for (size_t done = 0; done < total;)		 // copy out in pieces no bigger than the window keeps
+				{
+					size_t length = std::min<size_t>(total - done, 32768);
+					if (!inflateTo(done + length))
+						return;
+					inflator.copy(&scanlines[done], done, length);
+					done += length;
+				}
 				std::vector<unsigned char> scanlineo((info.width * bpp + 7) / 8), scanlinen((info.width * bpp + 7) / 8); //"old" and "new" scanline
 				for (int i = 0; i < 7; i++)
 					adam7Pass(&out_[0], &scanlinen[0], &scanlineo[0], &scanlines[passstart[i]], info.width, pattern[i], pattern[i + 7], pattern[i + 14], pattern[i + 21], passw[i], passh[i], bpp);
@@ -558,6 +655,7 @@ int decodePNG(std::vector<unsigned char> &out_image, uint16_t &image_width, uint
 				error = convert(out, &data[0], info, info.width, info.height);
 			}
 		}
+		bool streamSupported() const { return info.interlaceMethod == 0 && info.bitDepth >= 8; }
 		void readPngHeader(const unsigned char *in, size_t inlength) // read the information from the header and store it in the Info
 		{
 			if (inlength < 29)
@@ -740,10 +838,13 @@ int decodePNG(std::vector<unsigned char> &out_image, uint16_t &image_width, uint
 				return info.bitDepth;
 		}
 		int convert(std::vector<unsigned char> &out, const unsigned char *in, Info &infoIn, unsigned long w, unsigned long h)
+		{
+			out.resize(w * h * 4);
+			return convert(out.empty() ? 0 : &out[0], in, infoIn, w * h);
+		}
+		int convert(unsigned char *out_, const unsigned char *in, Info &infoIn, size_t numpixels)
 		{ // converts from any color type to 32-bit. return value = LodePNG error code
-			size_t numpixels = w * h, bp = 0;
-			out.resize(numpixels * 4);
-			unsigned char *out_ = out.empty() ? 0 : &out[0];   // faster if compiled without optimization
+			size_t bp = 0;
 			if (infoIn.bitDepth == 8 && infoIn.colorType == 0) // greyscale
 				for (size_t i = 0; i < numpixels; i++)
 				{
@@ -823,7 +924,11 @@ int decodePNG(std::vector<unsigned char> &out_image, uint16_t &image_width, uint
 																		 : c);
 		}
 	};
-	PNG decoder;
+} // namespace lodepng
+
+inline int decodePNG(std::vector<unsigned char> &out_image, uint16_t &image_width, uint16_t &image_height, const unsigned char *in_png, size_t in_size, bool convert_to_rgba32 = true)
+{
+	lodepng::PNG decoder;
 	decoder.decode(out_image, in_png, in_size, convert_to_rgba32);
 	image_width = decoder.info.width;
 	image_height = decoder.info.height;
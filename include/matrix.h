@@ -4,27 +4,46 @@
 #include <stdint.h>
 #include <string>
 #include <functional>
+#include <scoped_allocator>
 #include <vector>
+#include "arena.h"
+#include "rng.h"
 
 using function_t = std::function<double(double)>;
 
 class Matrix
 {
-    using matrix_t = std::vector<std::vector<double>>;
 public:
+    // Rows are built with the matrix's own allocator, so a matrix made inside an ArenaScope
+    // lives entirely in the arena and one made outside lives entirely on the heap
+    using row_t = std::vector<double, ArenaAllocator<double>>;
+    using matrix_t = std::vector<row_t, std::scoped_allocator_adaptor<ArenaAllocator<row_t>>>;
+
     Matrix() {}
     Matrix(const uint16_t _rows, const uint16_t _columns);
     Matrix(const Matrix &mat);
+    Matrix(Matrix &&mat) noexcept;
     Matrix(std::string file_string);
     ~Matrix(){};
 
+    // Assigning copies into the existing rows, so a matrix assigned the same shape every
+    // step keeps its memory. Moves take the buffers whenever both sides share an allocator
+    Matrix &operator=(const Matrix &mat);
+    Matrix &operator=(Matrix &&mat);
+    void swap(Matrix &mat);
+    // Reshapes without preserving entries, only allocating when a row has to grow
+    void resize(const uint16_t _rows, const uint16_t _columns);
+
     void print() const;
-    void save(std::string file_string);
-    void randomize(uint16_t n);
+    bool save(std::string file_string);
+    void randomize(uint16_t n, Rng &rng);
     uint32_t max_value();
     void flatten(bool axis);
 
     void dot(const Matrix &mat);
+    // Out-parameter forms for hot loops, out is resized and must not alias either operand
+    void dot_into(const Matrix &mat, Matrix &out) const;
+    void transpose_into(Matrix &out) const;
     void apply(function_t func);
     void add(const Matrix &mat);
     void subtract(const Matrix &mat);
@@ -35,13 +54,10 @@ public:
     Matrix soft_max();
 
     inline uint16_t rows() const { return m_entries.size(); }
-    inline uint16_t cols() const { return m_entries[0].size(); }
+    inline uint16_t cols() const { return m_entries.empty() ? 0 : m_entries[0].size(); }
     inline bool check_dimensions(const Matrix &mat) { return rows() == mat.rows() && cols() == mat.cols(); }
 
     matrix_t m_entries;
 };
 
-double sigmoid(double input);
-double sigmoid_prime(double input);
-
 #endif // MATRIX_H
\ No newline at end of file
@@ -1,32 +1,52 @@
 #ifndef NN_H
 #define NN_H
 
+#include "activation.h"
 #include "matrix.h"
 #include "img.h"
+#include "dataset.h"
+#include "batch_queue.h"
+
+const uint32_t min_pipeline_batch = 32; // Samples per queued batch when the training batch size is smaller
 
 class NeuralNetwork
 {
 private:
-    void train(Matrix _input, Matrix _output);
+    void train(const double *input, const bool label);
     Matrix predict(const Matrix &input_data);
-    void train_batch_imgs(const std::vector<Img>& imgs);
+    void train_dataset(const Dataset &dataset);
+    void train_dataset(const Dataset &dataset, const std::vector<uint32_t> &order);
+    void train_pipelined(const Dataset &dataset, uint16_t epochs, Rng *shuffle_rng);
     Matrix predict_img(Img img);
 
 public:
     NeuralNetwork(std::string file_string);
-    NeuralNetwork(int input, int hidden, int output);
+    NeuralNetwork(int input, int hidden, int output, uint64_t seed = 42, uint64_t id = 0);
     ~NeuralNetwork(){};
 
-	void train_model(const std::vector<Img>& imgs, uint16_t epochs, uint16_t batch_size, double learning_rate);
+	void train_model(const Dataset &dataset, uint16_t epochs, uint16_t batch_size, double learning_rate, Rng *shuffle_rng = nullptr);
+    // Number of threads assembling mini-batches ahead of train_model, 0 trains straight from the dataset
+    void set_loaders(unsigned n_loaders) { m_loaders = n_loaders; }
+    // Used by both layers when training and predicting, and saved with the weights
+    void set_activation(const Activation &activation) { m_activation = &activation; }
     double predict_batch_imgs(const std::vector<Img>& imgs);
-    void save(std::string file_string);
+    double score_batch(const Matrix &inputs, const std::vector<bool> &labels);
+    // score_batch for a copy of the weights, so a snapshot can be scored while the network keeps training
+    static double score_weights(const Matrix &hidden_weights, const Matrix &output_weights, const Matrix &inputs, const std::vector<bool> &labels,
+                                const Activation &activation = default_activation());
+    // Zeroes the given fraction of hidden weights, smallest magnitude first, and returns how
+    // many were zeroed. Ties at the cut off go in row order so the result is reproducible
+    uint32_t prune(double sparsity);
+    bool save(std::string file_string);
     void print() const;
 
     int m_input;
     int m_hidden;
     int m_output;
     double m_learning_rate = 0.1;
-    int m_batch_size;
+    int m_batch_size; // Only divides the learning rate, train still updates after every sample
+    unsigned m_loaders = 0;
+    const Activation *m_activation = &default_activation();
     Matrix m_hidden_weights;
     Matrix m_output_weights;
 };
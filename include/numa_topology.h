@@ -0,0 +1,40 @@
+#ifndef NUMA_TOPOLOGY_H
+#define NUMA_TOPOLOGY_H
+
+#include <stddef.h>
+#include <vector>
+
+// Which CPUs sit on which memory node, read once from libnuma when the build found it and
+// from sysfs otherwise. On a single node machine every call here is a no-op, so callers
+// can use it unconditionally
+class NumaTopology
+{
+public:
+    static const NumaTopology &get();
+
+    // Nodes with CPUs, numbered from 0 here whatever the kernel calls them
+    size_t nodes() const { return m_node_cpus.size(); }
+    bool multi_node() const { return nodes() > 1; }
+
+    // Spreads workers round robin over the nodes, -1 when there is only one
+    int node_for_worker(unsigned index) const { return multi_node() ? (int)(index % nodes()) : -1; }
+
+    // Keeps the calling thread on node's CPUs and, with libnuma, prefers node for its new
+    // pages. Without libnuma the kernel's first touch policy gives the same placement for
+    // memory the thread touches first. False if nothing was pinned
+    bool pin_to_node(int node) const;
+
+    // Memory bound to node with libnuma, or first touch placed without it. node < 0 is plain
+    // cache line aligned memory. Release with the same node and size
+    void *alloc_on_node(size_t size, int node) const;
+    void free_on_node(void *ptr, size_t size, int node) const;
+
+private:
+    NumaTopology();
+
+    std::vector<int> m_node_ids; // Kernel node number of each entry in m_node_cpus
+    std::vector<std::vector<int>> m_node_cpus;
+    bool m_libnuma = false;
+};
+
+#endif // NUMA_TOPOLOGY_H
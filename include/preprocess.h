@@ -1,8 +1,23 @@
 #ifndef PREPROCESS_H
 #define PREPROCESS_H
 
+#include "feature_cache.h"
+#include "file_prefetcher.h"
+#include "img.h"
 #include "lodepng.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <cstring>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <thread>
+#ifdef __AVX2__
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define DATASET_SIZE 600
 #define TRAINING_SPLIT 0.85
@@ -34,18 +49,38 @@ namespace preprocess
         }
     };
     
-    typedef std::vector<std::vector<uint8_t>> image_t;
     typedef std::vector<uint8_t> flat_image_t;
     typedef std::pair<int16_t, int16_t> pixel_index_t;
 
+    // Single channel image stored row after row in one buffer. Rows are padded
+    // out to a multiple of 16 bytes so every row can be walked a vector at a time
+    struct image_t
+    {
+        dimension_t size;
+        size_t stride = 0;
+        flat_image_t pixels;
+
+        image_t(const dimension_t _size = {}) { resize(_size); }
+
+        void resize(const dimension_t _size)
+        {
+            size = _size;
+            stride = (size.width + 15) & ~size_t(15);
+            pixels.assign(stride * size.height + 16, 0); // Slack so 4 byte gathers at the last pixel stay in bounds
+        }
+
+        inline uint8_t *row(const size_t _y) { return &pixels[_y * stride]; }
+        inline const uint8_t *row(const size_t _y) const { return &pixels[_y * stride]; }
+        inline uint8_t &at(const size_t _x, const size_t _y) { return pixels[_y * stride + _x]; }
+        inline uint8_t at(const size_t _x, const size_t _y) const { return pixels[_y * stride + _x]; }
+    };
+
     enum PartType
     {
         BadPart,
         GoodPart
     };
 
-    dimension_t image_size;
-
     void loadFile(flat_image_t &_buffer, const char *_file_name)
     {
         std::ifstream file(_file_name, std::ios::in | std::ios::binary | std::ios::ate);
@@ -65,175 +100,349 @@ namespace preprocess
             _buffer.clear();
     }
 
-    void open_image(flat_image_t &_image, const char *_file_name)
-    {
-        flat_image_t buffer;
-        loadFile(buffer, _file_name);
-        decodePNG(_image, image_size.width, image_size.height, buffer.empty() ? 0 : &buffer[0], (size_t)buffer.size());
-    }
-
-    void image_to_greyscale(const flat_image_t *_input_image, image_t &_output_image)
+    // Keeps the red channel of an RGBA buffer
+    void image_to_greyscale(const flat_image_t *_input_image, const dimension_t _size, image_t &_output_image)
     {
-        _output_image.resize(image_size.height, flat_image_t(image_size.width));
-        for (size_t y = 0; y < image_size.height; y++)
+        _output_image.resize(_size);
+        for (size_t y = 0; y < _size.height; y++)
         {
-            uint32_t y_offset = y * image_size.width * 4;
-            for (size_t x = 0; x < image_size.width; x++)
+            const uint8_t *in = &(*_input_image)[y * _size.width * 4];
+            uint8_t *out = _output_image.row(y);
+            size_t x = 0;
+#ifdef __SSE2__
+            const __m128i red_mask = _mm_set1_epi32(0xFF);
+            for (; x + 16 <= _size.width; x += 16)
+            {
+                __m128i p0 = _mm_and_si128(_mm_loadu_si128((const __m128i *)(in + x * 4)), red_mask);
+                __m128i p1 = _mm_and_si128(_mm_loadu_si128((const __m128i *)(in + x * 4 + 16)), red_mask);
+                __m128i p2 = _mm_and_si128(_mm_loadu_si128((const __m128i *)(in + x * 4 + 32)), red_mask);
+                __m128i p3 = _mm_and_si128(_mm_loadu_si128((const __m128i *)(in + x * 4 + 48)), red_mask);
+                __m128i lo = _mm_packs_epi32(p0, p1);
+                __m128i hi = _mm_packs_epi32(p2, p3);
+                _mm_storeu_si128((__m128i *)(out + x), _mm_packus_epi16(lo, hi));
+            }
+#endif
+            for (; x < _size.width; x++)
             {
-                _output_image[y][x] = _input_image->at(y_offset + (x * 4));
+                out[x] = in[x * 4];
             }
         }
     }
 
+    // Averages each _sample_area x _sample_area block into one pixel. Columns are
+    // summed down the block into 16 bit lanes first (255 * 255 still fits), then
+    // each run of _sample_area column sums is added into a 32 bit total
     void down_sample_by_average(image_t &_image, const uint8_t _sample_area)
     {
-        image_t tmp_image(image_size.height / _sample_area, flat_image_t(image_size.width / _sample_area));
-        uint16_t sample_area_sq = _sample_area * _sample_area;
+        const dimension_t new_size(_image.size.width / _sample_area, _image.size.height / _sample_area);
+        const uint32_t sample_area_sq = _sample_area * _sample_area;
+        const size_t used_width = new_size.width * _sample_area;
+        image_t tmp_image(new_size);
+        std::vector<uint16_t> column_totals(used_width + 16);
 
-        for (size_t y = 0; y < image_size.height; y += _sample_area)
+        for (size_t y = 0; y < new_size.height; y++)
         {
-            for (size_t x = 0; x < image_size.width; x += _sample_area)
-            {
-                uint16_t sampled_total = 0;
+            std::fill(column_totals.begin(), column_totals.end(), 0);
+            uint16_t *totals = &column_totals[0];
 
-                for (size_t sample_y = 0; sample_y < _sample_area; sample_y++)
+            for (size_t sample_y = 0; sample_y < _sample_area; sample_y++)
+            {
+                const uint8_t *in = _image.row(y * _sample_area + sample_y);
+                size_t x = 0;
+#ifdef __SSE2__
+                const __m128i zero = _mm_setzero_si128();
+                for (; x + 16 <= used_width; x += 16)
                 {
-                    for (size_t sample_x = 0; sample_x < _sample_area; sample_x++)
-                    {
-                        sampled_total += _image[y + sample_y][x + sample_x];
-                    }
+                    __m128i pixels = _mm_loadu_si128((const __m128i *)(in + x));
+                    __m128i lo = _mm_loadu_si128((const __m128i *)(totals + x));
+                    __m128i hi = _mm_loadu_si128((const __m128i *)(totals + x + 8));
+                    _mm_storeu_si128((__m128i *)(totals + x), _mm_add_epi16(lo, _mm_unpacklo_epi8(pixels, zero)));
+                    _mm_storeu_si128((__m128i *)(totals + x + 8), _mm_add_epi16(hi, _mm_unpackhi_epi8(pixels, zero)));
                 }
+#endif
+                for (; x < used_width; x++)
+                {
+                    totals[x] += in[x];
+                }
+            }
 
-                tmp_image[y / _sample_area][x / _sample_area] = sampled_total / sample_area_sq;
+            uint8_t *out = tmp_image.row(y);
+            for (size_t x = 0; x < new_size.width; x++)
+            {
+                uint32_t sampled_total = 0;
+                for (size_t sample_x = 0; sample_x < _sample_area; sample_x++)
+                {
+                    sampled_total += totals[x * _sample_area + sample_x];
+                }
+                out[x] = sampled_total / sample_area_sq;
             }
         }
 
-        image_size /= _sample_area;
-        _image.resize(image_size.height, flat_image_t(image_size.width));
-        _image = tmp_image; // Check if assigning resizes, may not need the line above
+        _image = std::move(tmp_image);
     }
 
+    // Pixels darker than the threshold become 1, everything else 0
     void threshold_image(image_t &_image, const uint8_t _threshold_value)
     {
-        for (auto &i : _image)
+        for (size_t y = 0; y < _image.size.height; y++)
         {
-            std::replace_if(
-                i.begin(), i.end(), [&](unsigned char &val)
-                { return val < _threshold_value; },
-                1);
-            std::replace_if(
-                i.begin(), i.end(), [&](unsigned char &val)
-                { return val >= _threshold_value; },
-                0);
+            uint8_t *row = _image.row(y);
+            size_t x = 0;
+#ifdef __SSE2__
+            const __m128i threshold = _mm_set1_epi8((char)_threshold_value);
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i one = _mm_set1_epi8(1);
+            for (; x < _image.stride; x += 16)
+            {
+                // threshold - val saturates to 0 exactly when val >= threshold
+                __m128i pixels = _mm_load_si128((const __m128i *)(row + x));
+                __m128i at_or_above = _mm_cmpeq_epi8(_mm_subs_epu8(threshold, pixels), zero);
+                _mm_store_si128((__m128i *)(row + x), _mm_andnot_si128(at_or_above, one));
+            }
+#endif
+            for (; x < _image.size.width; x++)
+            {
+                row[x] = row[x] < _threshold_value;
+            }
         }
     }
 
-    pixel_index_t operator-(const pixel_index_t &p1, const pixel_index_t &p2)
+    enum Interpolation
     {
-        return {p1.first - p2.first, p1.second - p2.second};
-    }
+        Nearest,
+        Bilinear
+    };
 
-    pixel_index_t operator+(const std::pair<double, double> &p1, const pixel_index_t &p2)
+    // Index of the first/last set pixel of _row in [_begin, _end), or -1 if there is none
+    int32_t first_set_pixel(const uint8_t *_row, size_t _begin, const size_t _end)
     {
-        return {p1.first + p2.first, p1.second + p2.second};
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        for (; _begin + 16 <= _end; _begin += 16)
+        {
+            const uint32_t set = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(_row + _begin)), zero)) & 0xFFFF;
+            if (set)
+                return _begin + __builtin_ctz(set);
+        }
+#endif
+        for (; _begin < _end; _begin++)
+        {
+            if (_row[_begin])
+                return _begin;
+        }
+        return -1;
     }
 
-    pixel_index_t translate_pixel(const pixel_index_t _desired_pos, const pixel_index_t _old_center, const pixel_index_t _new_center, const double _sin_angle, const double _cos_angle)
+    int32_t last_set_pixel(const uint8_t *_row, const size_t _begin, size_t _end)
     {
-        pixel_index_t translated_pos = _desired_pos - _new_center;
-        // Test if this needs to be a double,double
-        std::pair<double, double> rotated_pos = {_cos_angle * translated_pos.first - _sin_angle * translated_pos.second,
-                                                 _sin_angle * translated_pos.first + _cos_angle * translated_pos.second};
-        return rotated_pos + _old_center;
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        for (; _end >= _begin + 16; _end -= 16)
+        {
+            const uint32_t set = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(_row + _end - 16)), zero)) & 0xFFFF;
+            if (set)
+                return _end - 16 + (31 - __builtin_clz(set));
+        }
+#endif
+        for (; _end > _begin; _end--)
+        {
+            if (_row[_end - 1])
+                return _end - 1;
+        }
+        return -1;
     }
 
-    void crop_to_corners(image_t &_image, const image_t &_threshold_image, const dimension_t _new_dim = {50, 35})
+    // Finds the left, top, right and bottom most set pixels of a thresholded image.
+    // Rows are walked in memory order and every search stops as soon as it can no
+    // longer improve on the corner already found
+    bool find_corners(const image_t &_threshold_image, pixel_index_t _corner_pos[4])
     {
-        pixel_index_t corner_pos[4];
-        image_t tmp_image(_new_dim.height, flat_image_t(_new_dim.width));
+        const int32_t width = _threshold_image.size.width;
+        const int32_t height = _threshold_image.size.height;
+        int32_t first_row = 0, last_row = height - 1;
+
+        for (int i = 0; i < 4; i++)
+            _corner_pos[i] = {0, 0};
+
+        while (first_row < height && first_set_pixel(_threshold_image.row(first_row), 0, width) < 0)
+            first_row++;
+        if (first_row == height)
+            return false;
+        while (first_set_pixel(_threshold_image.row(last_row), 0, width) < 0)
+            last_row--;
+
+        // Top: first row with a set pixel past column 0, taking the rightmost one
+        for (int32_t y = first_row; y <= last_row; y++)
+        {
+            const int32_t x = last_set_pixel(_threshold_image.row(y), 1, width);
+            if (x >= 0)
+            {
+                _corner_pos[1] = {x, y};
+                break;
+            }
+        }
 
-        // Scan from left to right
-        [&]
+        // Bottom: last row below row 0 with a set pixel, taking the leftmost one
+        for (int32_t y = last_row; y > 0; y--)
         {
-            for (size_t x = 0; x < image_size.width; x++)
+            const int32_t x = first_set_pixel(_threshold_image.row(y), 0, width);
+            if (x >= 0)
             {
-                for (size_t y = 0; y < image_size.height; y++)
-                {
-                    if (int(_threshold_image[y][x]) == 1)
-                    {
-                        corner_pos[0] = {x, y};
-                        return;
-                    }
-                }
+                _corner_pos[3] = {x, y};
+                break;
             }
-        }();
+        }
 
-        // Scan from top to bottom
-        [&]
+        // Left: smallest column, earliest row on ties. Each row is only searched up to the best so far
+        int32_t best_left = width;
+        for (int32_t y = first_row; y <= last_row && best_left > 0; y++)
         {
-            for (size_t y = 0; y < image_size.height; y++)
+            const int32_t x = first_set_pixel(_threshold_image.row(y), 0, best_left);
+            if (x >= 0)
             {
-                for (size_t x = image_size.width - 1; x > 0; x--)
-                {
-                    if (int(_threshold_image[y][x]) == 1)
-                    {
-                        corner_pos[1] = {x, y};
-                        return;
-                    }
-                }
+                best_left = x;
+                _corner_pos[0] = {x, y};
             }
-        }();
+        }
 
-        // Scan from right to left
-        [&]
+        // Right: largest column past column 0, latest row on ties
+        int32_t best_right = 0;
+        for (int32_t y = last_row; y > 0 && y >= first_row && best_right < width - 1; y--)
         {
-            for (size_t x = image_size.width - 1; x > 0; x--)
+            const int32_t x = last_set_pixel(_threshold_image.row(y), best_right + 1, width);
+            if (x >= 0)
             {
-                for (size_t y = image_size.height - 1; y > 0; y--)
-                {
-                    if (int(_threshold_image[y][x]) == 1)
-                    {
-                        corner_pos[2] = {x, y};
-                        return;
-                    }
-                }
+                best_right = x;
+                _corner_pos[2] = {x, y};
             }
-        }();
+        }
+        return true;
+    }
 
-        // Scan from bottom to top
-        [&]
+    // Fills _output with _input rotated by _angle about _center, sampling out from
+    // the middle of _output. Source coordinates are stepped along each row in 16.16
+    // fixed point and clamped to the image edge. Returns false for an empty _input,
+    // which has no edge to clamp to
+    bool warp_rotate(const image_t &_input, image_t &_output, const pixel_index_t _center, const double _angle, const Interpolation _interpolation)
+    {
+        const int32_t width = _input.size.width;
+        const int32_t height = _input.size.height;
+        if (width <= 0 || height <= 0)
+            return false;
+
+        const int32_t stride = _input.stride;
+        const double sin_angle = std::sin(_angle);
+        const double cos_angle = std::cos(_angle);
+        const int32_t step_x = std::lround(cos_angle * 65536);
+        const int32_t step_y = std::lround(sin_angle * 65536);
+        const int32_t half_width = _output.size.width / 2;
+        const int32_t half_height = _output.size.height / 2;
+        const uint8_t *in = &_input.pixels[0];
+
+        // Nearest sampling is bilinear with the fractions forced to zero
+        const int32_t fraction_mask = _interpolation == Bilinear ? 0xFF : 0;
+
+        for (int32_t y = 0; y < _output.size.height; y++)
         {
-            for (size_t y = image_size.height - 1; y > 0; y--)
+            const int32_t dy = y - half_height;
+            int32_t sx = std::lround((cos_angle * -half_width - sin_angle * dy + _center.first) * 65536);
+            int32_t sy = std::lround((sin_angle * -half_width + cos_angle * dy + _center.second) * 65536);
+            uint8_t *out = _output.row(y);
+            int32_t x = 0;
+
+#ifdef __AVX2__
+            const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+            const __m256i lane_x = _mm256_mullo_epi32(lane, _mm256_set1_epi32(step_x));
+            const __m256i lane_y = _mm256_mullo_epi32(lane, _mm256_set1_epi32(step_y));
+            const __m256i zero = _mm256_setzero_si256();
+            const __m256i one = _mm256_set1_epi32(1);
+            const __m256i byte = _mm256_set1_epi32(0xFF);
+            const __m256i full = _mm256_set1_epi32(256);
+            const __m256i fractions = _mm256_set1_epi32(fraction_mask);
+            const __m256i max_x = _mm256_set1_epi32(width - 1);
+            const __m256i max_y = _mm256_set1_epi32(height - 1);
+            const __m256i row_stride = _mm256_set1_epi32(stride);
+
+            for (; x + 8 <= _output.size.width; x += 8)
             {
-                for (size_t x = 0; x < image_size.width; x++)
+                const __m256i vx = _mm256_add_epi32(_mm256_set1_epi32(sx), lane_x);
+                const __m256i vy = _mm256_add_epi32(_mm256_set1_epi32(sy), lane_y);
+
+                __m256i x0 = _mm256_srai_epi32(vx, 16);
+                __m256i y0 = _mm256_srai_epi32(vy, 16);
+                __m256i fx = _mm256_and_si256(_mm256_srli_epi32(vx, 8), fractions);
+                __m256i fy = _mm256_and_si256(_mm256_srli_epi32(vy, 8), fractions);
+
+                const __m256i out_x = _mm256_or_si256(_mm256_cmpgt_epi32(zero, x0), _mm256_cmpgt_epi32(x0, _mm256_sub_epi32(max_x, one)));
+                const __m256i out_y = _mm256_or_si256(_mm256_cmpgt_epi32(zero, y0), _mm256_cmpgt_epi32(y0, _mm256_sub_epi32(max_y, one)));
+                fx = _mm256_andnot_si256(out_x, fx);
+                fy = _mm256_andnot_si256(out_y, fy);
+                x0 = _mm256_min_epi32(_mm256_max_epi32(x0, zero), max_x);
+                y0 = _mm256_min_epi32(_mm256_max_epi32(y0, zero), max_y);
+
+                const __m256i y1 = _mm256_add_epi32(y0, _mm256_andnot_si256(_mm256_cmpeq_epi32(fy, zero), one));
+                const __m256i top = _mm256_i32gather_epi32((const int *)in, _mm256_add_epi32(_mm256_mullo_epi32(y0, row_stride), x0), 1);
+                const __m256i bottom = _mm256_i32gather_epi32((const int *)in, _mm256_add_epi32(_mm256_mullo_epi32(y1, row_stride), x0), 1);
+
+                const __m256i inv_fx = _mm256_sub_epi32(full, fx);
+                const __m256i top_mix = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_and_si256(top, byte), inv_fx),
+                                                         _mm256_mullo_epi32(_mm256_and_si256(_mm256_srli_epi32(top, 8), byte), fx));
+                const __m256i bottom_mix = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_and_si256(bottom, byte), inv_fx),
+                                                            _mm256_mullo_epi32(_mm256_and_si256(_mm256_srli_epi32(bottom, 8), byte), fx));
+                __m256i value = _mm256_add_epi32(_mm256_mullo_epi32(top_mix, _mm256_sub_epi32(full, fy)), _mm256_mullo_epi32(bottom_mix, fy));
+                value = _mm256_srli_epi32(_mm256_add_epi32(value, _mm256_set1_epi32(32768)), 16);
+
+                const __m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(value), _mm256_extracti128_si256(value, 1));
+                _mm_storel_epi64((__m128i *)(out + x), _mm_packus_epi16(packed, packed));
+
+                sx += 8 * step_x;
+                sy += 8 * step_y;
+            }
+#endif
+            for (; x < _output.size.width; x++, sx += step_x, sy += step_y)
+            {
+                int32_t x0 = sx >> 16, y0 = sy >> 16;
+                int32_t fx = (sx >> 8) & fraction_mask, fy = (sy >> 8) & fraction_mask;
+
+                if (x0 < 0 || x0 >= width - 1)
                 {
-                    if (int(_threshold_image[y][x]) == 1)
-                    {
-                        corner_pos[3] = {x, y};
-                        return;
-                    }
+                    x0 = std::min(std::max(x0, 0), width - 1);
+                    fx = 0;
+                }
+                if (y0 < 0 || y0 >= height - 1)
+                {
+                    y0 = std::min(std::max(y0, 0), height - 1);
+                    fy = 0;
                 }
+
+                const uint8_t *top = in + y0 * stride + x0;
+                const uint8_t *bottom = fy ? top + stride : top;
+                const int32_t top_mix = top[0] * (256 - fx) + (fx ? top[1] * fx : 0);
+                const int32_t bottom_mix = bottom[0] * (256 - fx) + (fx ? bottom[1] * fx : 0);
+                out[x] = (top_mix * (256 - fy) + bottom_mix * fy + 32768) >> 16;
             }
-        }();
+        }
+        return true;
+    }
+
+    // Crops _new_dim around the part, turned level. Returns false and leaves _image alone
+    // when the thresholded image has no part in it, an empty image included
+    bool crop_to_corners(image_t &_image, const image_t &_threshold_image, const dimension_t _new_dim = {50, 35}, const Interpolation _interpolation = Nearest)
+    {
+        pixel_index_t corner_pos[4];
+        image_t tmp_image(_new_dim);
+
+        if (!find_corners(_threshold_image, corner_pos))
+            return false;
 
         pixel_index_t center = {(corner_pos[0].first + corner_pos[1].first + corner_pos[2].first + corner_pos[3].first) / 4,
                                 (corner_pos[0].second + corner_pos[1].second + corner_pos[2].second + corner_pos[3].second) / 4};
         double angle = std::atan2(corner_pos[1].second - corner_pos[0].second, corner_pos[1].first - corner_pos[0].first);
-        double sin_angle = std::sin(angle);
-        double cos_angle = std::cos(angle);
-
-        for (size_t y = 0; y < _new_dim.height; y++)
-        {
-            for (size_t x = 0; x < _new_dim.width; x++)
-            {
-                pixel_index_t input_index = translate_pixel({x, y}, center, {_new_dim.width / 2, _new_dim.height / 2}, sin_angle, cos_angle);
-                tmp_image[y][x] = _image[input_index.second][input_index.first];
-            }
-        }
 
-        image_size = _new_dim;
-        _image.resize(image_size.height, flat_image_t(image_size.width));
-        _image = tmp_image;
+        if (!warp_rotate(_image, tmp_image, center, angle, _interpolation))
+            return false;
+        _image = std::move(tmp_image);
+        return true;
     }
 
     void save_to_file(const image_t &_image, const char *_file_name, const PartType _part_type)
@@ -241,11 +450,11 @@ namespace preprocess
         std::ofstream output_file;
         output_file.open(_file_name, std::ofstream::app);
         output_file << int(_part_type);
-        for (size_t y = 0; y < image_size.height; y++)
+        for (size_t y = 0; y < _image.size.height; y++)
         {
-            for (size_t x = 0; x < image_size.width; x++)
+            for (size_t x = 0; x < _image.size.width; x++)
             {
-                output_file << "," << int(_image[y][x]);
+                output_file << "," << int(_image.at(x, y));
             }
         }
         for (size_t i = 0; i < 11; i++)
@@ -257,6 +466,22 @@ namespace preprocess
         output_file.close();
     }
 
+    // The Img load_csv would read back from the row save_to_file writes: the first 64
+    // pixels in row order as an 8x8 matrix, scaled by 1/256
+    Img to_img(const image_t &_image, const PartType _part_type)
+    {
+        Img img = {Matrix(8, 8), _part_type == GoodPart};
+        size_t i = 0;
+        for (size_t y = 0; y < _image.size.height && i < 64; y++)
+        {
+            for (size_t x = 0; x < _image.size.width && i < 64; x++, i++)
+            {
+                img.img_data.m_entries[i / 8][i % 8] = _image.at(x, y) / 256.0;
+            }
+        }
+        return img;
+    }
+
     void clear_files(const char **_files, const uint8_t _num_files)
     {
         for (int i = 0; i < _num_files; i++)
@@ -273,22 +498,22 @@ namespace preprocess
     {
         FILE *f;
         unsigned char *img = NULL;
-        int filesize = 54 + 3 * image_size.width * image_size.height;
+        int filesize = 54 + 3 * _image.size.width * _image.size.height;
 
-        img = (unsigned char *)std::malloc(3 * image_size.width * image_size.height);
-        std::memset(img, 0, 3 * image_size.width * image_size.height);
+        img = (unsigned char *)std::malloc(3 * _image.size.width * _image.size.height);
+        std::memset(img, 0, 3 * _image.size.width * _image.size.height);
         int x, y, v;
 
-        for (int y = 0; y < image_size.height; y++)
+        for (int y = 0; y < _image.size.height; y++)
         {
-            for (int x = 0; x < image_size.width; x++)
+            for (int x = 0; x < _image.size.width; x++)
             {
-                v = _image[y][x];
+                v = _image.at(x, y);
                 if (v > 255)
                     v = 255;
-                img[(x + y * image_size.width) * 3 + 2] = (unsigned char)(v);
-                img[(x + y * image_size.width) * 3 + 1] = (unsigned char)(v);
-                img[(x + y * image_size.width) * 3 + 0] = (unsigned char)(v);
+                img[(x + y * _image.size.width) * 3 + 2] = (unsigned char)(v);
+                img[(x + y * _image.size.width) * 3 + 1] = (unsigned char)(v);
+                img[(x + y * _image.size.width) * 3 + 0] = (unsigned char)(v);
             }
         }
 
@@ -301,41 +526,416 @@ namespace preprocess
         bmpfileheader[4] = (unsigned char)(filesize >> 16);
         bmpfileheader[5] = (unsigned char)(filesize >> 24);
 
-        bmpinfoheader[4] = (unsigned char)(image_size.width);
-        bmpinfoheader[5] = (unsigned char)(image_size.width >> 8);
-        bmpinfoheader[6] = (unsigned char)(image_size.width >> 16);
-        bmpinfoheader[7] = (unsigned char)(image_size.width >> 24);
-        bmpinfoheader[8] = (unsigned char)(image_size.height);
-        bmpinfoheader[9] = (unsigned char)(image_size.height >> 8);
-        bmpinfoheader[10] = (unsigned char)(image_size.height >> 16);
-        bmpinfoheader[11] = (unsigned char)(image_size.height >> 24);
+        bmpinfoheader[4] = (unsigned char)(_image.size.width);
+        bmpinfoheader[5] = (unsigned char)(_image.size.width >> 8);
+        bmpinfoheader[6] = (unsigned char)(_image.size.width >> 16);
+        bmpinfoheader[7] = (unsigned char)(_image.size.width >> 24);
+        bmpinfoheader[8] = (unsigned char)(_image.size.height);
+        bmpinfoheader[9] = (unsigned char)(_image.size.height >> 8);
+        bmpinfoheader[10] = (unsigned char)(_image.size.height >> 16);
+        bmpinfoheader[11] = (unsigned char)(_image.size.height >> 24);
 
         f = fopen("../output.bmp", "wb");
         fwrite(bmpfileheader, 1, 14, f);
         fwrite(bmpinfoheader, 1, 40, f);
-        for (int i = 0; i < image_size.height; i++)
+        for (int i = 0; i < _image.size.height; i++)
         {
-            fwrite(img + (image_size.width * (image_size.height - i - 1) * 3), 3, image_size.width, f);
-            fwrite(bmppad, 1, (4 - (image_size.width * 3) % 4) % 4, f);
+            fwrite(img + (_image.size.width * (_image.size.height - i - 1) * 3), 3, _image.size.width, f);
+            fwrite(bmppad, 1, (4 - (_image.size.width * 3) % 4) % 4, f);
         }
 
         free(img);
         fclose(f);
     }
 
-    void process_condensed(const char *_in_file_name, const char *_out_file_name, const PartType _part_type)
+    // Everything that decides what condense() produces. Bump version whenever the pipeline
+    // itself changes, so features cached by the old code stop matching
+    struct condense_params_t
+    {
+        uint8_t sample_area = 10; // Averaged before the part is found
+        uint8_t threshold = 90;
+        dimension_t crop = {50, 35};
+        Interpolation interpolation = Nearest; // What the shipped datasets and network were made with
+        uint8_t final_sample_area = 5;         // Averaged after the crop
+        bool roi_decode = true;                // Only average the blocks the crop can reach, see PngDecoder::decode_roi
+        uint32_t version = 1;
+
+        uint64_t hash() const
+        {
+            const uint32_t fields[] = {sample_area, threshold, crop.width, crop.height, interpolation, final_sample_area, roi_decode, version};
+            return FeatureCache::hash(fields, sizeof(fields));
+        }
+    };
+
+    // Everything one thread needs to decode frames. The file buffer, the inflate window,
+    // Huffman tables and row buffers are kept from one file to the next, so once the first
+    // frame has sized them decoding no longer allocates. Use one context per worker thread
+    class PngDecoder
+    {
+    public:
+        PngDecoder(const condense_params_t &_params = condense_params_t()) : m_params(_params), m_params_hash(_params.hash()) {}
+
+        // Decodes the frame one scanline at a time and averages the red channel of every
+        // _sample_area square as the rows go by, giving the same image as image_to_greyscale
+        // followed by down_sample_by_average without the full RGBA frame ever existing.
+        // Returns false if the PNG is invalid
+        bool decode_downsampled(const flat_image_t &_buffer, image_t &_image, const uint8_t _sample_area)
+        {
+            m_png.open(_buffer.empty() ? 0 : &_buffer[0], _buffer.size());
+            if (m_png.error)
+                return false;
+
+            const size_t width = m_png.info.width;
+            const bool streamed = m_png.streamSupported();
+            const bool direct = m_png.info.bitDepth == 8 && (m_png.info.colorType == 2 || m_png.info.colorType == 6);
+            const size_t pixel_bytes = direct ? m_png.getBpp(m_png.info) / 8 : 4; // Red is the first byte of every pixel either way
+            const dimension_t new_size(m_png.info.width / _sample_area, m_png.info.height / _sample_area);
+            const uint32_t sample_area_sq = _sample_area * _sample_area;
+            const size_t used_width = new_size.width * _sample_area;
+            m_column_totals.resize(used_width);
+
+            if (!streamed)
+            {
+                m_png.decodeOpened(m_rgba, true);
+                if (m_png.error)
+                    return false;
+            }
+            else if (!direct)
+                m_rgba.resize(width * 4);
+
+            _image.resize(new_size);
+            for (size_t y = 0; y < new_size.height; y++)
+            {
+                std::fill(m_column_totals.begin(), m_column_totals.end(), 0);
+
+                for (size_t sample_y = 0; sample_y < _sample_area; sample_y++)
+                {
+                    const uint8_t *in;
+                    if (!streamed)
+                        in = &m_rgba[(y * _sample_area + sample_y) * width * 4];
+                    else
+                    {
+                        in = m_png.nextScanline();
+                        if (!in)
+                            return false;
+                        if (!direct)
+                        {
+                            if (m_png.convert(&m_rgba[0], in, m_png.info, width))
+                                return false;
+                            in = &m_rgba[0];
+                        }
+                    }
+
+                    for (size_t x = 0; x < used_width; x++)
+                    {
+                        m_column_totals[x] += in[x * pixel_bytes];
+                    }
+                }
+
+                uint8_t *out = _image.row(y);
+                for (size_t x = 0; x < new_size.width; x++)
+                {
+                    uint32_t sampled_total = 0;
+                    for (size_t sample_x = 0; sample_x < _sample_area; sample_x++)
+                    {
+                        sampled_total += m_column_totals[x * _sample_area + sample_x];
+                    }
+                    out[x] = sampled_total / sample_area_sq;
+                }
+            }
+            return true;
+        }
+
+        bool decode_downsampled(const char *_file_name, image_t &_image, const uint8_t _sample_area)
+        {
+            loadFile(m_file, _file_name);
+            return decode_downsampled(m_file, _image, _sample_area);
+        }
+
+        // decode_downsampled cut down to the window of blocks the crop can reach. PNG filters
+        // chain every row to the one above, so a coarse pass still unfilters each row, keeping
+        // them all, but converts only the middle pixel of every block, which is enough to find
+        // the part. The window pass then converts and averages only the kept rows and columns
+        // the crop can reach and stops after the window's last row. The crop is relative to the
+        // part, so it comes out as the full decode's whenever the window holds every block the
+        // full image thresholds as part, which is what the coarse pass looks for. Frames it
+        // can't stream, frames too large to keep and frames with no part found fall back to
+        // decode_downsampled
+        bool decode_roi(const flat_image_t &_buffer, image_t &_image, const uint8_t _sample_area)
+        {
+            m_png.open(_buffer.empty() ? 0 : &_buffer[0], _buffer.size());
+            if (m_png.error)
+                return false;
+
+            const size_t line_length = m_png.lineLength();
+            const int32_t blocks_w = m_png.info.width / _sample_area;
+            const int32_t blocks_h = m_png.info.height / _sample_area;
+            const size_t used_rows = blocks_h * _sample_area;
+            if (!m_png.streamSupported() || !line_length || used_rows > roi_max_bytes / line_length)
+                return decode_downsampled(_buffer, _image, _sample_area);
+
+            const bool direct = m_png.info.bitDepth == 8 && (m_png.info.colorType == 2 || m_png.info.colorType == 6);
+            const size_t pixel_bytes = m_png.getBpp(m_png.info) / 8;
+            m_coarse.resize(dimension_t(blocks_w, blocks_h));
+            m_rows.resize(used_rows * line_length);
+
+            for (int32_t y = 0; y < blocks_h; y++)
+            {
+                for (size_t sample_y = 0; sample_y < _sample_area; sample_y++)
+                {
+                    uint8_t *row = &m_rows[(y * _sample_area + sample_y) * line_length];
+                    const uint8_t *line = m_png.nextScanlineInto(row, y || sample_y ? row - line_length : 0);
+                    if (!line)
+                        return false;
+                    if (sample_y != _sample_area / 2)
+                        continue;
+
+                    uint8_t *out = m_coarse.row(y);
+                    for (int32_t x = 0; x < blocks_w; x++)
+                    {
+                        const uint8_t *red = red_channel(line, x * _sample_area + _sample_area / 2, 1, direct, pixel_bytes);
+                        if (!red)
+                            return false;
+                        out[x] = *red;
+                    }
+                }
+            }
+
+            pixel_index_t corner_pos[4];
+            threshold_image(m_coarse, m_params.threshold);
+            if (!find_corners(m_coarse, corner_pos))
+                return decode_downsampled(_buffer, _image, _sample_area);
+
+            // Cover the part itself and every pixel the rotated crop around its centre can sample
+            const int32_t margin = 3;
+            const dimension_t crop = m_params.crop;
+            const int32_t radius = std::ceil(std::sqrt(crop.width * crop.width + crop.height * crop.height) / 2.0);
+            const int32_t center_x = (corner_pos[0].first + corner_pos[1].first + corner_pos[2].first + corner_pos[3].first) / 4;
+            const int32_t center_y = (corner_pos[0].second + corner_pos[1].second + corner_pos[2].second + corner_pos[3].second) / 4;
+            int32_t x0 = center_x - radius;
+            int32_t y0 = center_y - radius;
+            int32_t x1 = center_x + radius;
+            int32_t y1 = center_y + radius;
+            for (int i = 0; i < 4; i++)
+            {
+                x0 = std::min<int32_t>(x0, corner_pos[i].first);
+                y0 = std::min<int32_t>(y0, corner_pos[i].second);
+                x1 = std::max<int32_t>(x1, corner_pos[i].first);
+                y1 = std::max<int32_t>(y1, corner_pos[i].second);
+            }
+            x0 = std::max(x0 - margin, 0);
+            y0 = std::max(y0 - margin, 0);
+            x1 = std::min(x1 + margin + 1, blocks_w);
+            y1 = std::min(y1 + margin + 1, blocks_h);
+
+            const size_t first_pixel = x0 * _sample_area;
+            const size_t used_width = (x1 - x0) * _sample_area;
+            const size_t stride = direct ? pixel_bytes : 4;
+            const uint32_t sample_area_sq = _sample_area * _sample_area;
+            m_column_totals.resize(used_width);
+            _image.resize(dimension_t(x1 - x0, y1 - y0));
+
+            for (int32_t y = y0; y < y1; y++)
+            {
+                std::fill(m_column_totals.begin(), m_column_totals.end(), 0);
+
+                for (size_t sample_y = 0; sample_y < _sample_area; sample_y++)
+                {
+                    const uint8_t *in = red_channel(&m_rows[(y * _sample_area + sample_y) * line_length], first_pixel, used_width, direct, pixel_bytes);
+                    if (!in)
+                        return false;
+                    for (size_t x = 0; x < used_width; x++)
+                    {
+                        m_column_totals[x] += in[x * stride];
+                    }
+                }
+
+                uint8_t *out = _image.row(y - y0);
+                for (int32_t x = 0; x < x1 - x0; x++)
+                {
+                    uint32_t sampled_total = 0;
+                    for (size_t sample_x = 0; sample_x < _sample_area; sample_x++)
+                    {
+                        sampled_total += m_column_totals[x * _sample_area + sample_x];
+                    }
+                    out[x] = sampled_total / sample_area_sq;
+                }
+            }
+            return true;
+        }
+
+        // Decodes one frame and condenses it to the features the network reads. Returns false
+        // if the PNG is invalid or no part was found in it
+        bool condense(const char *_file_name, image_t &_image)
+        {
+            loadFile(m_file, _file_name);
+            return condense(m_file, _image);
+        }
+
+        bool condense(const flat_image_t &_buffer, image_t &_image)
+        {
+            if (!(m_params.roi_decode ? decode_roi(_buffer, _image, m_params.sample_area) : decode_downsampled(_buffer, _image, m_params.sample_area)))
+                return false;
+            m_thresh_image = _image;
+            threshold_image(m_thresh_image, m_params.threshold);
+            if (!crop_to_corners(_image, m_thresh_image, m_params.crop, m_params.interpolation))
+                return false;
+            down_sample_by_average(_image, m_params.final_sample_area);
+            return true;
+        }
+
+        // Condenses every file in order into _images and returns how many decoded.
+        // A file that fails to decode leaves an empty image behind
+        size_t condense_batch(const std::vector<std::string> &_file_names, std::vector<image_t> &_images)
+        {
+            size_t decoded = 0;
+            _images.resize(_file_names.size());
+            for (size_t i = 0; i < _file_names.size(); i++)
+            {
+                decoded += condense_into(_file_names[i], _images[i]);
+            }
+            return decoded;
+        }
+
+        bool condense_into(const std::string &_file_name, image_t &_image)
+        {
+            loadFile(m_file, _file_name.c_str());
+            return condense_into(m_file, true, _image);
+        }
+
+        // With a cache, frames whose bytes and parameters were seen before are copied out
+        // of it instead of decoded, and newly condensed frames are added to it
+        bool condense_into(const flat_image_t &_buffer, const bool _read_ok, image_t &_image, FeatureCache *_cache = nullptr)
+        {
+            if (!_read_ok)
+            {
+                _image = image_t();
+                return false;
+            }
+
+            uint64_t key = 0;
+            if (_cache)
+            {
+                uint16_t width, height;
+                key = FeatureCache::key(_buffer.data(), _buffer.size(), m_params_hash);
+                if (_cache->find(key, width, height, m_cached))
+                {
+                    _image.resize(dimension_t(width, height));
+                    for (size_t y = 0; y < height; y++)
+                    {
+                        std::copy(&m_cached[y * width], &m_cached[y * width] + width, _image.row(y));
+                    }
+                    return true;
+                }
+            }
+
+            if (!condense(_buffer, _image))
+            {
+                _image = image_t();
+                return false;
+            }
+
+            if (_cache)
+            {
+                m_cached.resize(_image.size.width * _image.size.height);
+                for (size_t y = 0; y < _image.size.height; y++)
+                {
+                    std::copy(_image.row(y), _image.row(y) + _image.size.width, &m_cached[y * _image.size.width]);
+                }
+                _cache->insert(key, _image.size.width, _image.size.height, m_cached.data());
+            }
+            return true;
+        }
+
+    private:
+        static const size_t roi_max_bytes = 1 << 26; // Unfiltered rows decode_roi keeps, larger frames are streamed
+
+        // The _count pixels from _first of an unfiltered row, as bytes whose first is red every
+        // direct ? pixel_bytes : 4 bytes. 0 if the pixels don't convert
+        const uint8_t *red_channel(const uint8_t *_line, const size_t _first, const size_t _count, const bool _direct, const size_t _pixel_bytes)
+        {
+            if (_direct)
+                return _line + _first * _pixel_bytes;
+            m_rgba.resize(_count * 4);
+            if (m_png.convert(&m_rgba[0], _line + _first * _pixel_bytes, m_png.info, _count))
+                return 0;
+            return &m_rgba[0];
+        }
+
+        condense_params_t m_params;
+        uint64_t m_params_hash;
+        flat_image_t m_cached;
+        lodepng::PNG m_png;
+        flat_image_t m_file, m_rgba;
+        std::vector<uint16_t> m_column_totals;
+        image_t m_thresh_image;
+        image_t m_coarse;
+        flat_image_t m_rows; // Every unfiltered row of the frame, for decode_roi's window pass
+    };
+
+    // Condenses a frame sent for inference exactly as preprocess does, into the 64 pixels the
+    // network reads, with one decoder per calling thread. Requests are untrusted, so frames
+    // smaller than a sample area or with no part in them come back false
+    bool condense_request(const flat_image_t &_png, uint8_t *_pixels)
+    {
+        thread_local PngDecoder decoder;
+        thread_local image_t image;
+        if (!decoder.condense(_png, image) || !image.size.width || !image.size.height)
+            return false;
+
+        size_t i = 0;
+        std::fill(_pixels, _pixels + 64, 0);
+        for (size_t y = 0; y < image.size.height && i < 64; y++)
+        {
+            for (size_t x = 0; x < image.size.width && i < 64; x++, i++)
+            {
+                _pixels[i] = image.at(x, y);
+            }
+        }
+        return true;
+    }
+
+    bool open_image_downsampled(const flat_image_t &_buffer, image_t &_image, const uint8_t _sample_area)
+    {
+        PngDecoder decoder;
+        return decoder.decode_downsampled(_buffer, _image, _sample_area);
+    }
+
+    // condense_batch spread over _n_threads workers, each with its own PngDecoder. A
+    // FilePrefetcher keeps _reads_in_flight files loading ahead of them, and files are
+    // decoded in whatever order their reads finish so one slow read holds up nobody.
+    // Frames already in _cache are still read, to hash them, but never decoded
+    size_t condense_files(const std::vector<std::string> &_file_names, std::vector<image_t> &_images, const unsigned _n_threads,
+                          FeatureCache *_cache = nullptr, const condense_params_t &_params = condense_params_t(), const unsigned _reads_in_flight = 8)
     {
-        flat_image_t buffer;
-        image_t image, thresh_image;
-
-        open_image(buffer, _in_file_name);
-        image_to_greyscale(&buffer, image);
-        down_sample_by_average(image, 10);
-        thresh_image = image;
-        threshold_image(thresh_image, 90);
-        crop_to_corners(image, thresh_image);
-        down_sample_by_average(image, 5);
-        save_to_file(image, _out_file_name, _part_type);
+        std::vector<PngDecoder> decoders(std::max(1u, std::min<unsigned>(_n_threads, _file_names.size())), PngDecoder(_params));
+        std::atomic<size_t> decoded(0);
+        _images.resize(_file_names.size());
+
+        FilePrefetcher prefetcher(_file_names, _reads_in_flight, _reads_in_flight + decoders.size());
+
+        auto worker = [&](PngDecoder &_decoder)
+        {
+            PrefetchedFile file;
+            while (prefetcher.next(file))
+            {
+                decoded += _decoder.condense_into(*file.data, file.ok, _images[file.index], _cache);
+                prefetcher.release(file);
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < decoders.size(); i++)
+        {
+            threads.push_back(std::thread(worker, std::ref(decoders[i])));
+        }
+        worker(decoders[0]);
+
+        for (std::thread &th : threads)
+        {
+            th.join();
+        }
+        return decoded;
     }
 } // namespace preprocess
 
@@ -0,0 +1,76 @@
+#ifndef RESULTS_SINK_H
+#define RESULTS_SINK_H
+
+#include "tuner.h"
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+
+enum class SinkFormat
+{
+    Csv,
+    JsonLines,
+    Binary // Header "NNSC" + version, then packed BinaryScoreRecords
+};
+
+enum class FsyncPolicy
+{
+    Never,
+    EveryBatch,
+    OnClose
+};
+
+#pragma pack(push, 1)
+struct BinaryScoreRecord
+{
+    uint32_t trial;
+    double score;
+    double learning_rate;
+    uint16_t hidden_nodes;
+    uint16_t epochs;
+    uint16_t batch_size;
+};
+#pragma pack(pop)
+
+// Trials push scores from any thread without locking, a single writer thread
+// drains them in batches so the file is opened once and written with few syscalls
+class ResultsSink
+{
+public:
+    ResultsSink(const std::string &file_string, SinkFormat format, FsyncPolicy fsync_policy = FsyncPolicy::OnClose,
+                size_t capacity = 1024, size_t batch_size = 64);
+    ~ResultsSink();
+
+    bool is_open() const { return m_fd >= 0; }
+    void push(const TrialResult &result);
+    void close();
+
+private:
+    struct Slot
+    {
+        std::atomic<size_t> sequence;
+        TrialResult result;
+    };
+
+    bool pop(TrialResult &result);
+    void format(const TrialResult &result);
+    void flush_buffer();
+    void writer_loop();
+
+    int m_fd;
+    SinkFormat m_format;
+    FsyncPolicy m_fsync_policy;
+    size_t m_batch_size;
+
+    std::unique_ptr<Slot[]> m_slots; // Bounded MPSC ring, capacity is a power of two
+    size_t m_mask;
+    alignas(64) std::atomic<size_t> m_enqueue_pos;
+    alignas(64) size_t m_dequeue_pos;
+
+    std::string m_buffer;
+    std::atomic<bool> m_running;
+    std::thread m_writer;
+};
+
+#endif // RESULTS_SINK_H
@@ -0,0 +1,120 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+// Sub-streams handed out per trial, so every purpose draws from its own sequence
+enum RngStream
+{
+    WeightInit,
+    Shuffle,
+    Dropout,
+    NumRngStreams
+};
+
+// xoshiro256** seeded through splitmix64. Each generator is independent state,
+// so threads never share or lock anything, and jump() skips 2^128 draws ahead
+// to give non-overlapping streams that do not depend on which thread asks first
+class Rng
+{
+public:
+    explicit Rng(uint64_t seed = 42, uint64_t stream = 0)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            seed += 0x9E3779B97F4A7C15ULL;
+            uint64_t z = seed;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            m_state[i] = z ^ (z >> 31);
+        }
+
+        for (uint64_t i = 0; i < stream; i++)
+            jump();
+    }
+
+    // Stream for one purpose of one trial, e.g. Rng::stream(seed, trial_id, Shuffle)
+    static Rng stream(uint64_t seed, uint64_t id, RngStream purpose)
+    {
+        return Rng(seed, id * NumRngStreams + purpose);
+    }
+
+    uint64_t next()
+    {
+        const uint64_t result = rotl(m_state[1] * 5, 7) * 9;
+        const uint64_t t = m_state[1] << 17;
+
+        m_state[2] ^= m_state[0];
+        m_state[3] ^= m_state[1];
+        m_state[1] ^= m_state[2];
+        m_state[0] ^= m_state[3];
+        m_state[2] ^= t;
+        m_state[3] = rotl(m_state[3], 45);
+
+        return result;
+    }
+
+    // Uniform in [0, 1) with 53 bits of precision
+    double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+    double uniform(double min, double max) { return min + (max - min) * uniform(); }
+
+    // Unbiased integer in [0, n)
+    uint32_t below(uint32_t n)
+    {
+        uint64_t m = (next() >> 32) * n;
+        uint32_t low = (uint32_t)m;
+        if (low < n)
+        {
+            const uint32_t threshold = (0u - n) % n;
+            while (low < threshold)
+            {
+                m = (next() >> 32) * n;
+                low = (uint32_t)m;
+            }
+        }
+        return m >> 32;
+    }
+
+    bool bernoulli(double p) { return uniform() < p; }
+
+    // Fisher-Yates, spelled out so the order is the same on every standard library
+    template <typename T>
+    void shuffle(std::vector<T> &values)
+    {
+        for (size_t i = values.size(); i > 1; i--)
+        {
+            std::swap(values[i - 1], values[below(i)]);
+        }
+    }
+
+    void jump()
+    {
+        static const uint64_t JUMP[] = {0x180EC6D33CFD0ABAULL, 0xD5A61266F0C9392CULL, 0xA9582618E03FC9AAULL, 0x39ABDC4529B1661CULL};
+
+        uint64_t s[4] = {0, 0, 0, 0};
+        for (int i = 0; i < 4; i++)
+        {
+            for (int b = 0; b < 64; b++)
+            {
+                if (JUMP[i] & (1ULL << b))
+                {
+                    for (int j = 0; j < 4; j++)
+                        s[j] ^= m_state[j];
+                }
+                next();
+            }
+        }
+
+        for (int j = 0; j < 4; j++)
+            m_state[j] = s[j];
+    }
+
+private:
+    static inline uint64_t rotl(const uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+    uint64_t m_state[4];
+};
+
+#endif // RNG_H
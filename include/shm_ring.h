@@ -0,0 +1,72 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+struct ShmSlot
+{
+    uint32_t id;
+    uint8_t format;
+    uint32_t size;
+    alignas(64) uint8_t data[1]; // slot_size bytes in the mapping
+};
+
+// Single producer, single consumer ring of fixed size slots in POSIX shared memory, for
+// handing frames between processes on one box without copying or a socket round trip.
+// The producer fills a slot in place between begin_write and end_write, the consumer
+// reads it in place between begin_read and end_read. A waiting side spins briefly and
+// then sleeps on a futex over the ring's own counters, so a handoff costs two atomic
+// stores and, only when the other side is asleep, one wake syscall
+class ShmRing
+{
+public:
+    // The creating side sizes and initialises the ring and unlinks it again on destruction,
+    // the other side attaches to an existing one and slots/slot_size are read from it
+    ShmRing(const std::string &name, bool create, uint32_t slots = 64, uint32_t slot_size = 1 << 20);
+    ~ShmRing();
+    ShmRing(const ShmRing &) = delete;
+    ShmRing &operator=(const ShmRing &) = delete;
+
+    bool is_open() const { return m_header != nullptr; }
+    uint32_t slot_size() const { return m_slot_size; }
+
+    // Null once interrupted, or when timeout_us runs out (negative waits forever)
+    uint8_t *begin_write(int64_t timeout_us = -1);
+    void end_write(uint32_t id, uint8_t format, uint32_t size);
+    const ShmSlot *begin_read(int64_t timeout_us = -1);
+    void end_read();
+
+    // Wakes this process's waiters and fails their waits from then on, safe in a signal handler
+    void interrupt();
+
+private:
+    struct Header
+    {
+        char magic[4]; // "NNSR"
+        uint32_t version;
+        uint32_t slots;
+        uint32_t slot_size;
+        alignas(64) std::atomic<uint32_t> head; // Slots published, the consumer's futex word
+        std::atomic<uint32_t> consumer_waiting;
+        alignas(64) std::atomic<uint32_t> tail; // Slots released, the producer's futex word
+        std::atomic<uint32_t> producer_waiting;
+    };
+
+    ShmSlot *slot(uint32_t position) const { return (ShmSlot *)(m_slots + (size_t)(position & (m_slot_count - 1)) * m_slot_stride); }
+    bool wait_for(std::atomic<uint32_t> &word, std::atomic<uint32_t> &waiting, uint32_t busy_value, int64_t timeout_us);
+    static void wake(std::atomic<uint32_t> &word, std::atomic<uint32_t> &waiting);
+
+    std::string m_name;
+    bool m_owner;
+    Header *m_header = nullptr;
+    uint8_t *m_slots = nullptr;
+    size_t m_map_size = 0;
+    uint32_t m_slot_count = 0;
+    uint32_t m_slot_size = 0;
+    size_t m_slot_stride = 0;
+    std::atomic<bool> m_interrupted;
+};
+
+#endif // SHM_RING_H
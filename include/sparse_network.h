@@ -0,0 +1,46 @@
+#ifndef SPARSE_NETWORK_H
+#define SPARSE_NETWORK_H
+
+#include <stdint.h>
+#include <vector>
+#include "dataset.h"
+#include "nn.h"
+
+// Inference only copy of a pruned NeuralNetwork. The hidden layer keeps just its non-zero
+// weights, grouped by input the way StaticNetwork lays out the dense layer (CSR of the
+// transposed weights), and inputs whose every weight was pruned are dropped altogether so
+// the kernel never reads them. Inputs that kept most of their weights are stored whole
+// instead, which costs a few zeros but lets that part of the kernel vectorise. Each hidden
+// sum still runs over inputs in order, so outputs are bit for bit those of the dense
+// network with the same weights zeroed. The output layer is small and stays dense
+class SparseNetwork
+{
+public:
+    SparseNetwork(const NeuralNetwork &net);
+
+    // output holds outputs() entries. Safe to call from several threads at once
+    void forward(const double *input, double *output) const;
+    uint32_t predict(const double *input) const;
+    double score(const Dataset &dataset) const;
+
+    uint16_t inputs() const { return m_input; }
+    uint16_t outputs() const { return m_output; }
+    size_t live_inputs() const { return m_live_inputs.size(); }
+    size_t stored_weights() const { return m_values.size(); }
+    // Bytes of weights and indices held, the most a sample can touch
+    size_t footprint() const;
+
+private:
+    uint16_t m_input;
+    uint16_t m_hidden;
+    uint16_t m_output;
+
+    std::vector<uint16_t> m_live_inputs; // Inputs with at least one weight left
+    std::vector<uint32_t> m_starts;      // Where each live input's weights begin, plus an end marker
+    std::vector<uint16_t> m_nodes;       // Hidden node of each kept weight, a whole input stores all m_hidden
+    std::vector<double> m_values;
+    std::vector<double> m_output_weights; // Hidden major, m_output per hidden node
+    double (*m_activation)(double);
+};
+
+#endif // SPARSE_NETWORK_H
@@ -0,0 +1,181 @@
+#ifndef STATIC_NETWORK_H
+#define STATIC_NETWORK_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <array>
+#include <new>
+#include <string>
+#include "dataset.h"
+#include "nn.h"
+
+// Inference only copy of a NeuralNetwork whose shape is fixed at compile time. Weights
+// live inline in the object, stored input major so each layer is a run of constant length
+// axpy loops the compiler unrolls and vectorises without reordering any sums, which keeps
+// the outputs bit for bit equal to the dynamic network. At 64x200x2 the object is ~100KB,
+// so keep it on the heap or in static storage rather than on a thread's stack. C++14 new
+// ignores the alignas on the weights, so the class allocates its own aligned storage
+template <uint16_t In, uint16_t Hidden, uint16_t Out>
+class StaticNetwork
+{
+public:
+    static constexpr uint16_t inputs = In;
+    static constexpr uint16_t hidden = Hidden;
+    static constexpr uint16_t outputs = Out;
+
+    static void *operator new(size_t size)
+    {
+        void *ptr = nullptr;
+        if (posix_memalign(&ptr, alignof(StaticNetwork), size) != 0)
+            throw std::bad_alloc();
+        return ptr;
+    }
+
+    static void operator delete(void *ptr) { free(ptr); }
+
+    // False if the network or checkpoint has a different shape, the weights are left untouched
+    bool load(const NeuralNetwork &net)
+    {
+        if (net.m_input != In || net.m_hidden != Hidden || net.m_output != Out || !load(net.m_hidden_weights, net.m_output_weights))
+            return false;
+        m_activation = net.m_activation->forward;
+        return true;
+    }
+
+    // Reads a directory written by NeuralNetwork::save
+    bool load(const std::string &file_string)
+    {
+        int shape[3];
+        char name[32] = "sigmoid"; // Older checkpoints don't name their activation
+        FILE *descriptor = fopen((file_string + "/descriptor").c_str(), "r");
+        if (!descriptor)
+            return false;
+        const bool read = fscanf(descriptor, "%d %d %d", &shape[0], &shape[1], &shape[2]) == 3;
+        if (read && fscanf(descriptor, "%31s", name) != 1)
+            strcpy(name, "sigmoid");
+        fclose(descriptor);
+        const Activation *activation = find_activation(name);
+        if (!read || !activation || shape[0] != In || shape[1] != Hidden || shape[2] != Out)
+            return false;
+
+        Matrix hidden_weights(Hidden, In);
+        Matrix output_weights(Out, Hidden);
+        if (!read_matrix(file_string + "/hidden", hidden_weights) || !read_matrix(file_string + "/output", output_weights) ||
+            !load(hidden_weights, output_weights))
+            return false;
+        m_activation = activation->forward;
+        return true;
+    }
+
+    void forward(const double *input, std::array<double, Out> &output) const
+    {
+        alignas(64) std::array<double, Hidden> hidden_calculations{};
+        for (uint16_t k = 0; k < In; k++)
+        {
+            const double x = input[k];
+            const std::array<double, Hidden> &weights = m_hidden_weights[k];
+            for (uint16_t i = 0; i < Hidden; i++)
+            {
+                hidden_calculations[i] += weights[i] * x;
+            }
+        }
+        for (double &h : hidden_calculations)
+        {
+            h = m_activation(h);
+        }
+
+        output.fill(0);
+        for (uint16_t i = 0; i < Hidden; i++)
+        {
+            const double h = hidden_calculations[i];
+            const std::array<double, Out> &weights = m_output_weights[i];
+            for (uint16_t j = 0; j < Out; j++)
+            {
+                output[j] += weights[j] * h;
+            }
+        }
+        for (double &o : output)
+        {
+            o = m_activation(o);
+        }
+    }
+
+    uint32_t predict(const double *input) const
+    {
+        std::array<double, Out> output;
+        forward(input, output);
+
+        uint32_t max_idx = 0;
+        for (uint32_t j = 1; j < Out; j++)
+        {
+            if (output[j] > output[max_idx])
+                max_idx = j;
+        }
+        return max_idx;
+    }
+
+    double score(const Dataset &dataset) const
+    {
+        if (dataset.features() != In || dataset.size() == 0)
+            return 0;
+
+        size_t n_correct = 0;
+        for (size_t i = 0; i < dataset.size(); i++)
+        {
+            n_correct += predict(dataset.sample(i)) == dataset.label(i);
+        }
+        return 1.0 * n_correct / dataset.size();
+    }
+
+private:
+    bool load(const Matrix &hidden_weights, const Matrix &output_weights)
+    {
+        if (hidden_weights.rows() != Hidden || hidden_weights.cols() != In || output_weights.rows() != Out || output_weights.cols() != Hidden)
+            return false;
+
+        for (uint16_t i = 0; i < Hidden; i++)
+        {
+            for (uint16_t k = 0; k < In; k++)
+            {
+                m_hidden_weights[k][i] = hidden_weights.m_entries[i][k];
+            }
+        }
+        for (uint16_t j = 0; j < Out; j++)
+        {
+            for (uint16_t i = 0; i < Hidden; i++)
+            {
+                m_output_weights[i][j] = output_weights.m_entries[j][i];
+            }
+        }
+        return true;
+    }
+
+    // Same layout as Matrix::save, but checked instead of trusting the file
+    static bool read_matrix(const std::string &file_string, Matrix &mat)
+    {
+        FILE *file = fopen(file_string.c_str(), "r");
+        if (!file)
+            return false;
+
+        int rows = 0, cols = 0;
+        bool ok = fscanf(file, "%d %d", &rows, &cols) == 2 && rows == mat.rows() && cols == mat.cols();
+        for (int i = 0; ok && i < rows; i++)
+        {
+            for (int j = 0; ok && j < cols; j++)
+            {
+                ok = fscanf(file, "%lf", &mat.m_entries[i][j]) == 1;
+            }
+        }
+
+        fclose(file);
+        return ok;
+    }
+
+    alignas(64) std::array<std::array<double, Hidden>, In> m_hidden_weights;
+    alignas(64) std::array<std::array<double, Out>, Hidden> m_output_weights;
+    double (*m_activation)(double) = sigmoid;
+};
+
+#endif // STATIC_NETWORK_H
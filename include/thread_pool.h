@@ -0,0 +1,125 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stddef.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+const size_t parallel_min_work = 1 << 15; // Multiply-adds below which splitting costs more than it saves
+
+// Persistent helper threads that split one operation across cores. Helpers come out of a
+// fixed budget of cores, and threads that are already busy in parallel, like tuning
+// workers, reserve their cores from the same budget, so intra-op work only ever fills
+// cores nobody else is using and never oversubscribes the machine
+class ThreadPool
+{
+public:
+    ThreadPool(unsigned n_helpers);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // The pool Matrix operations use. It has one helper fewer than set_shared_threads asked
+    // for, the caller being the last core, and is built on first use
+    static ThreadPool &shared();
+    static void set_shared_threads(unsigned n_threads);
+
+    // Runs func(begin, end) over [0, n) in chunks of at least grain on the calling thread
+    // and whichever helpers are free, returning once every chunk is done. Each index is
+    // visited exactly once, so results never depend on how many helpers joined in
+    template <typename F>
+    void parallel_for(size_t n, size_t grain, F &&func);
+
+    // Takes up to n cores out of the budget for threads outside the pool, returns how many
+    // it got. Give them back with release
+    unsigned reserve(unsigned n);
+    void release(unsigned n);
+
+    unsigned helpers() const { return m_threads.size(); }
+
+private:
+    struct Job
+    {
+        void (*run)(void *context, size_t begin, size_t end);
+        void *context;
+        size_t n;
+        size_t grain;
+        std::atomic<size_t> next;
+        unsigned helpers_left; // Guarded by m_mutex
+    };
+
+    template <typename F>
+    static void run_chunk(void *context, size_t begin, size_t end) { (*(F *)context)(begin, end); }
+
+    void run(Job &job, unsigned wanted);
+    static void work_on(Job &job);
+    void helper_loop();
+
+    std::atomic<int> m_free; // Helpers nobody has claimed, less any reserved cores
+    std::mutex m_mutex;
+    std::condition_variable m_job_posted;
+    std::condition_variable m_job_done;
+    std::vector<Job *> m_posted; // One entry per helper asked for, never outgrows its reserve
+    bool m_stopping = false;
+    std::vector<std::thread> m_threads;
+};
+
+template <typename F>
+void ThreadPool::parallel_for(size_t n, size_t grain, F &&func)
+{
+    grain = std::max<size_t>(1, grain);
+    const size_t chunks = (n + grain - 1) / grain;
+    if (chunks <= 1 || m_threads.empty())
+    {
+        if (n)
+            func(0, n);
+        return;
+    }
+
+    // The callable is reached through a plain pointer, so handing work out never allocates
+    using func_t = typename std::remove_reference<F>::type;
+    Job job;
+    job.run = &run_chunk<func_t>;
+    job.context = (void *)&func;
+    job.n = n;
+    job.grain = grain;
+    job.next = 0;
+    job.helpers_left = 0;
+    run(job, std::min<size_t>(chunks - 1, m_threads.size()));
+}
+
+// Holds cores out of a pool's budget for as long as it lives
+class CoreReservation
+{
+public:
+    CoreReservation(ThreadPool &pool, unsigned n) : m_pool(pool), m_reserved(pool.reserve(n)) {}
+    ~CoreReservation() { m_pool.release(m_reserved); }
+    CoreReservation(const CoreReservation &) = delete;
+    CoreReservation &operator=(const CoreReservation &) = delete;
+
+private:
+    ThreadPool &m_pool;
+    unsigned m_reserved;
+};
+
+// Calls func(begin, end) over row ranges of a rows x cols operation, split on the shared
+// pool once there is parallel_min_work for at least two chunks and serially below that
+template <typename F>
+void parallel_rows(size_t rows, size_t cols, F &&func)
+{
+    const size_t work = rows * std::max<size_t>(1, cols);
+    if (work < 2 * parallel_min_work)
+    {
+        if (rows)
+            func(0, rows);
+        return;
+    }
+    ThreadPool::shared().parallel_for(rows, parallel_min_work / std::max<size_t>(1, cols), func);
+}
+
+#endif // THREAD_POOL_H
@@ -0,0 +1,166 @@
+#ifndef TRAINER_H
+#define TRAINER_H
+
+#include "nn.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct TrainingState
+{
+    uint16_t epoch = 0;     // Number of epochs trained so far
+    double score = 0;       // Most recent validation score
+    uint16_t score_epoch = 0; // Epoch the score was measured at, trails epoch when validating asynchronously
+    double best_score = 0;  // Best validation score seen so far
+    uint16_t best_epoch = 0;
+    bool validated = false; // True when score was refreshed this epoch
+    bool stop = false;      // Set by a callback to end training early
+};
+
+using score_callback_t = std::function<void(const TrainingState &)>;
+
+class TrainingCallback
+{
+public:
+    virtual ~TrainingCallback() {}
+
+    virtual void on_train_begin(NeuralNetwork &net, TrainingState &state) {}
+    virtual void on_epoch_end(NeuralNetwork &net, TrainingState &state) = 0;
+    virtual void on_train_end(NeuralNetwork &net, TrainingState &state) {}
+};
+
+// Scores the network on a held out set every `interval` epochs without printing
+class ValidationCallback : public TrainingCallback
+{
+public:
+    ValidationCallback(const std::vector<Img> &imgs, uint16_t interval, score_callback_t on_score = nullptr);
+    ValidationCallback(const Matrix &inputs, const std::vector<bool> &labels, uint16_t interval, score_callback_t on_score = nullptr);
+
+    void on_epoch_end(NeuralNetwork &net, TrainingState &state) override;
+
+private:
+    Matrix m_inputs;
+    std::vector<bool> m_labels;
+    uint16_t m_interval;
+    score_callback_t m_on_score;
+};
+
+// Weights copied out of a network at one epoch
+struct WeightSnapshot
+{
+    Matrix hidden_weights;
+    Matrix output_weights;
+    const Activation *activation = &default_activation();
+};
+
+// Scores weight snapshots on its own threads, so trainers hand validation off and keep
+// going. One worker can be shared by every trainer in a process
+class ValidationWorker
+{
+public:
+    ValidationWorker(unsigned n_threads = 1);
+    ~ValidationWorker();
+
+    // inputs and labels must outlive the returned future
+    std::future<double> submit(std::shared_ptr<const WeightSnapshot> snapshot, const Matrix &inputs, const std::vector<bool> &labels);
+
+private:
+    void worker_loop();
+
+    std::deque<std::packaged_task<double()>> m_jobs;
+    bool m_stopping = false;
+    std::mutex m_mutex;
+    std::condition_variable m_job_added;
+    std::vector<std::thread> m_threads;
+};
+
+// ValidationCallback that snapshots the weights every `interval` epochs and scores them on
+// a ValidationWorker while training continues. A snapshot's score is folded into the state
+// when the next snapshot is taken, by which point it has had a whole interval to finish, so
+// training rarely waits and the epochs early stopping sees do not depend on thread timing.
+// The best snapshot is kept and, with restore_best, put back when training ends
+class AsyncValidationCallback : public TrainingCallback
+{
+public:
+    AsyncValidationCallback(ValidationWorker &worker, const Matrix &inputs, const std::vector<bool> &labels, uint16_t interval,
+                            score_callback_t on_score = nullptr, bool restore_best = true);
+
+    void on_train_begin(NeuralNetwork &net, TrainingState &state) override;
+    void on_epoch_end(NeuralNetwork &net, TrainingState &state) override;
+    void on_train_end(NeuralNetwork &net, TrainingState &state) override;
+
+private:
+    struct Pending
+    {
+        uint16_t epoch;
+        std::shared_ptr<const WeightSnapshot> snapshot;
+        std::future<double> score;
+    };
+
+    void fold(TrainingState &state);
+
+    ValidationWorker &m_worker;
+    const Matrix &m_inputs;
+    const std::vector<bool> &m_labels;
+    uint16_t m_interval;
+    score_callback_t m_on_score;
+    bool m_restore_best;
+    std::deque<Pending> m_pending;
+    std::shared_ptr<const WeightSnapshot> m_best;
+};
+
+// Stops once `patience` validations in a row fail to beat the best score by min_delta
+class EarlyStopping : public TrainingCallback
+{
+public:
+    EarlyStopping(uint16_t patience, double min_delta = 0.0);
+
+    void on_train_begin(NeuralNetwork &net, TrainingState &state) override;
+    void on_epoch_end(NeuralNetwork &net, TrainingState &state) override;
+
+private:
+    uint16_t m_patience;
+    uint16_t m_wait = 0;
+    double m_min_delta;
+    double m_best = -1.0;
+};
+
+// Keeps a copy of the best scoring weights and restores them when training ends
+class BestCheckpoint : public TrainingCallback
+{
+public:
+    BestCheckpoint(bool restore_on_end = true) : m_restore_on_end(restore_on_end) {}
+
+    void on_train_begin(NeuralNetwork &net, TrainingState &state) override;
+    void on_epoch_end(NeuralNetwork &net, TrainingState &state) override;
+    void on_train_end(NeuralNetwork &net, TrainingState &state) override;
+
+private:
+    bool m_restore_on_end;
+    bool m_has_checkpoint = false;
+    Matrix m_hidden_weights;
+    Matrix m_output_weights;
+};
+
+class Trainer
+{
+public:
+    Trainer(NeuralNetwork &net, const Dataset &dataset) : m_net(net), m_dataset(dataset) {}
+
+    void add_callback(TrainingCallback *callback) { m_callbacks.push_back(callback); }
+    void set_shuffle(Rng *shuffle_rng) { m_shuffle_rng = shuffle_rng; }
+    TrainingState fit(uint16_t max_epochs, uint16_t batch_size, double learning_rate);
+
+private:
+    NeuralNetwork &m_net;
+    const Dataset &m_dataset;
+    std::vector<TrainingCallback *> m_callbacks;
+    Rng *m_shuffle_rng = nullptr; // Visits samples in dataset order when unset
+};
+
+#endif // TRAINER_H
@@ -0,0 +1,102 @@
+#ifndef TUNER_H
+#define TUNER_H
+
+#include "nn.h"
+#include "thread_pool.h"
+#include "trainer.h"
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct hyperparameters
+{
+    uint16_t hidden_nodes;
+    double learning_rate;
+    uint16_t batch_size;
+    uint16_t epochs;
+};
+
+struct SearchSpace
+{
+    std::vector<uint16_t> hidden_nodes;
+    std::vector<uint16_t> batch_sizes;
+    double min_learning_rate; // Learning rates are sampled log-uniformly
+    double max_learning_rate;
+    uint16_t min_epochs;
+    uint16_t max_epochs;
+};
+
+struct TrialResult
+{
+    uint32_t id;
+    hyperparameters params; // params.epochs holds the epochs trained when scored
+    double score;
+};
+
+const uint16_t validation_interval = 5;
+const uint16_t early_stopping_patience = 4;
+
+using result_callback_t = std::function<void(const TrialResult &)>;
+
+class Tuner
+{
+public:
+    // The training set is shared by reference across every trial and must outlive the tuner.
+    // On a multi node machine workers are pinned round robin to the nodes and read a
+    // replica of it made on their own node. n_threads covers the validators as well as the
+    // training workers, so a tune never runs more busy threads than it was given
+    Tuner(const SearchSpace &space, const Dataset &train_set, const std::vector<Img> &test_imgs,
+          unsigned n_threads, uint64_t seed = 42);
+
+    // Called from worker threads every time a trial is scored, must be thread safe
+    void set_on_result(result_callback_t on_result) { m_on_result = on_result; }
+
+    // Trains every trial to its sampled epoch budget, cut short when validation plateaus
+    std::vector<TrialResult> random_search(uint32_t n_trials);
+    std::vector<TrialResult> successive_halving(uint32_t n_trials, uint16_t min_epochs, uint16_t eta);
+    std::vector<TrialResult> hyperband(uint16_t eta);
+
+    // Writes every scored trial to a temporary file and renames it over file_string
+    bool save_results(const std::string &file_string) const;
+
+    const std::vector<TrialResult> &results() const { return m_results; }
+
+private:
+    struct Trial
+    {
+        uint32_t id;
+        hyperparameters params;
+        std::unique_ptr<NeuralNetwork> net; // Built lazily on the worker from (seed, id)
+        int node = -1;                      // Where net was built, later rungs prefer a worker there
+        Rng shuffle_rng;
+        uint16_t epochs_trained = 0;
+        double score = 0;
+        std::future<double> pending_score; // Set while the end of rung score is still being computed
+    };
+
+    hyperparameters sample();
+    std::vector<Trial> create_trials(uint32_t n_trials);
+    void run_rung(std::vector<Trial *> &trials, uint16_t target_epochs, bool early_stopping = false);
+    std::vector<TrialResult> run_halving(std::vector<Trial> &trials, uint16_t min_epochs, uint16_t eta);
+    const Dataset &train_set_on(int node);
+
+    SearchSpace m_space;
+    const Dataset &m_train_set;
+    std::vector<std::unique_ptr<Dataset>> m_replicas; // Per node copies of m_train_set, made on first use
+    std::unique_ptr<std::once_flag[]> m_replica_once;
+    Matrix m_test_inputs;
+    std::vector<bool> m_test_labels;
+    unsigned m_n_threads; // Training workers, what's left of n_threads after the validators
+    ValidationWorker m_validator; // Scores snapshots off the training threads
+    CoreReservation m_validator_cores; // Keeps intra-op helpers off the validators' cores
+    uint32_t m_next_id = 0;
+    uint64_t m_seed;
+    Rng m_rng;
+    result_callback_t m_on_result;
+    std::vector<TrialResult> m_results;
+};
+
+#endif // TUNER_H
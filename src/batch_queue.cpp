@@ -0,0 +1,90 @@
+#include "batch_queue.h"
+#include <thread>
+
+BatchQueue::BatchQueue(size_t capacity) : m_enqueue_pos(0), m_dequeue_pos(0)
+{
+	size_t rounded_capacity = 2;
+	while (rounded_capacity < capacity)
+		rounded_capacity <<= 1;
+
+	m_mask = rounded_capacity - 1;
+	m_slots.reset(new Slot[rounded_capacity]);
+	for (size_t i = 0; i < rounded_capacity; i++)
+	{
+		m_slots[i].sequence.store(i, std::memory_order_relaxed);
+	}
+}
+
+bool BatchQueue::begin_push(size_t limit, size_t &ticket, MiniBatch *&batch)
+{
+	size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		if (pos >= limit)
+			return false;
+
+		Slot &slot = m_slots[pos & m_mask];
+		const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+		const intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+
+		if (diff == 0)
+		{
+			if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				ticket = pos;
+				batch = &slot.batch;
+				return true;
+			}
+		}
+		else if (diff < 0)
+		{
+			// Ring is full, wait for the consumer to catch up
+			std::this_thread::yield();
+			pos = m_enqueue_pos.load(std::memory_order_relaxed);
+		}
+		else
+		{
+			pos = m_enqueue_pos.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+void BatchQueue::end_push(size_t ticket)
+{
+	m_slots[ticket & m_mask].sequence.store(ticket + 1, std::memory_order_release);
+}
+
+MiniBatch &BatchQueue::begin_pop(size_t &ticket)
+{
+	size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		Slot &slot = m_slots[pos & m_mask];
+		const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+		const intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+
+		if (diff == 0)
+		{
+			if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				ticket = pos;
+				return slot.batch;
+			}
+		}
+		else if (diff < 0)
+		{
+			// Next batch is still being assembled
+			std::this_thread::yield();
+			pos = m_dequeue_pos.load(std::memory_order_relaxed);
+		}
+		else
+		{
+			pos = m_dequeue_pos.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+void BatchQueue::end_pop(size_t ticket)
+{
+	m_slots[ticket & m_mask].sequence.store(ticket + m_mask + 1, std::memory_order_release);
+}
@@ -0,0 +1,54 @@
+#include "dataset.h"
+#include <string.h>
+
+#define CACHE_LINE 64
+
+Dataset::Dataset(const std::vector<Img> &imgs)
+{
+	if (imgs.empty())
+		return;
+
+	const uint16_t img_rows = imgs[0].img_data.rows();
+	const uint16_t img_cols = imgs[0].img_data.cols();
+	const size_t line_doubles = CACHE_LINE / sizeof(double);
+
+	m_features = img_rows * img_cols;
+	m_stride = (m_features + line_doubles - 1) / line_doubles * line_doubles;
+
+	allocate(imgs.size(), -1);
+	memset(m_data.get(), 0, imgs.size() * m_stride * sizeof(double));
+
+	m_labels.resize(imgs.size());
+	for (size_t n = 0; n < imgs.size(); n++)
+	{
+		double *row = m_data.get() + n * m_stride;
+		for (int i = 0; i < img_rows; i++)
+		{
+			for (int j = 0; j < img_cols; j++)
+			{
+				row[i * img_cols + j] = imgs[n].img_data.m_entries[i][j];
+			}
+		}
+		m_labels[n] = imgs[n].label;
+	}
+}
+
+Dataset::Dataset(const Dataset &source, int node)
+	: m_features(source.m_features), m_stride(source.m_stride), m_labels(source.m_labels)
+{
+	if (source.size() == 0)
+		return;
+
+	// Written by the calling thread, which is what places the pages without libnuma
+	allocate(source.size(), node);
+	memcpy(m_data.get(), source.m_data.get(), source.size() * m_stride * sizeof(double));
+}
+
+void Dataset::allocate(size_t n_samples, int node)
+{
+	const size_t size = n_samples * m_stride * sizeof(double);
+	void *buffer = NumaTopology::get().alloc_on_node(size, node);
+	if (!buffer)
+		exit(1);
+	m_data = std::unique_ptr<double[], NodeDeleter>((double *)buffer, NodeDeleter(size, node));
+}
@@ -0,0 +1,207 @@
+#include "feature_cache.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+
+static const uint32_t cache_version = 1;
+
+static inline uint64_t mix(uint64_t x)
+{
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+FeatureCache::FeatureCache(const std::string &file_string) : m_file_string(file_string)
+{
+	map();
+}
+
+FeatureCache::~FeatureCache()
+{
+	unmap();
+}
+
+void FeatureCache::map()
+{
+	const int fd = open(m_file_string.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	struct stat info;
+	if (fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(Header))
+	{
+		m_map = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (m_map == MAP_FAILED)
+			m_map = nullptr;
+		else
+			m_map_size = info.st_size;
+	}
+	close(fd);
+
+	if (!m_map)
+		return;
+
+	const Header *header = (const Header *)m_map;
+	const size_t table_end = sizeof(Header) + header->count * sizeof(Entry);
+	if (memcmp(header->magic, "NNFC", 4) != 0 || header->version != cache_version || header->count > m_map_size / sizeof(Entry) || table_end > m_map_size)
+	{
+		printf("Ignoring unreadable feature cache '%s'\n", m_file_string.c_str());
+		unmap();
+		return;
+	}
+
+	m_count = header->count;
+	m_entries = (const Entry *)((const uint8_t *)m_map + sizeof(Header));
+	m_blob = (const uint8_t *)m_map + table_end;
+	m_used.assign(m_count, false);
+}
+
+void FeatureCache::unmap()
+{
+	if (m_map)
+		munmap(m_map, m_map_size);
+	m_map = nullptr;
+	m_map_size = 0;
+	m_entries = nullptr;
+	m_blob = nullptr;
+	m_count = 0;
+	m_used.clear();
+}
+
+// 8 bytes per step through a splitmix style finaliser. Not cryptographic, but a collision
+// needs two different frames of the same size to agree on all 64 bits
+uint64_t FeatureCache::hash(const void *data, size_t size, uint64_t seed)
+{
+	const uint8_t *bytes = (const uint8_t *)data;
+	uint64_t h = mix(seed ^ (size * 0x9E3779B97F4A7C15ULL));
+
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8)
+	{
+		uint64_t word;
+		memcpy(&word, bytes + i, 8);
+		h = (h ^ mix(word)) * 0x9FB21C651E98DF25ULL;
+		h ^= h >> 29;
+	}
+
+	uint64_t tail = 0;
+	memcpy(&tail, bytes + i, size - i);
+	return mix(h ^ mix(tail ^ 0xFF));
+}
+
+bool FeatureCache::find(uint64_t key, uint16_t &width, uint16_t &height, std::vector<uint8_t> &pixels)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	const Entry *end = m_entries + m_count;
+	const Entry *entry = std::lower_bound(m_entries, end, key, [](const Entry &a, uint64_t k)
+										  { return a.key < k; });
+	if (entry != end && entry->key == key && m_blob + entry->offset + (size_t)entry->width * entry->height <= (const uint8_t *)m_map + m_map_size)
+	{
+		width = entry->width;
+		height = entry->height;
+		pixels.assign(m_blob + entry->offset, m_blob + entry->offset + (size_t)width * height);
+		m_used[entry - m_entries] = true;
+		m_hits++;
+		return true;
+	}
+
+	auto added = m_added_index.find(key);
+	if (added != m_added_index.end())
+	{
+		width = m_added[added->second].entry.width;
+		height = m_added[added->second].entry.height;
+		pixels = m_added[added->second].pixels;
+		m_hits++;
+		return true;
+	}
+
+	m_misses++;
+	return false;
+}
+
+void FeatureCache::insert(uint64_t key, uint16_t width, uint16_t height, const uint8_t *pixels)
+{
+	Added added;
+	added.entry = {key, 0, width, height};
+	added.pixels.assign(pixels, pixels + (size_t)width * height);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_added_index.insert(std::make_pair(key, m_added.size())).second)
+		m_added.push_back(std::move(added));
+}
+
+bool FeatureCache::save(bool keep_unused)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	std::vector<Entry> entries;
+	std::vector<const uint8_t *> sources;
+	for (size_t i = 0; i < m_count; i++)
+	{
+		const bool in_bounds = m_blob + m_entries[i].offset + (size_t)m_entries[i].width * m_entries[i].height <= (const uint8_t *)m_map + m_map_size;
+		if (in_bounds && (keep_unused || m_used[i]))
+		{
+			entries.push_back(m_entries[i]);
+			sources.push_back(m_blob + m_entries[i].offset);
+		}
+	}
+	for (const Added &added : m_added)
+	{
+		entries.push_back(added.entry);
+		sources.push_back(added.pixels.data());
+	}
+
+	std::vector<size_t> order(entries.size());
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		order[i] = i;
+	}
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+					 { return entries[a].key < entries[b].key; });
+
+	std::vector<Entry> table;
+	std::vector<uint8_t> blob;
+	for (size_t i : order)
+	{
+		// The same frame added twice in one run only needs one entry
+		if (!table.empty() && table.back().key == entries[i].key)
+			continue;
+
+		Entry entry = entries[i];
+		const size_t length = (size_t)entry.width * entry.height;
+		entry.offset = blob.size();
+		table.push_back(entry);
+		blob.insert(blob.end(), sources[i], sources[i] + length);
+	}
+
+	const std::string tmp_string = m_file_string + ".tmp";
+	FILE *file = fopen(tmp_string.c_str(), "wb");
+	if (!file)
+		return false;
+
+	Header header = {{'N', 'N', 'F', 'C'}, cache_version, table.size()};
+	fwrite(&header, sizeof(header), 1, file);
+	fwrite(table.data(), sizeof(Entry), table.size(), file);
+	fwrite(blob.data(), 1, blob.size(), file);
+
+	const bool written = !ferror(file);
+	fflush(file);
+	fsync(fileno(file));
+	fclose(file);
+
+	if (!written || rename(tmp_string.c_str(), m_file_string.c_str()) != 0)
+		return false;
+
+	// Everything now lives in the new file, so start serving from it
+	m_added.clear();
+	m_added_index.clear();
+	unmap();
+	map();
+	return true;
+}
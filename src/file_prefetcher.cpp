@@ -0,0 +1,129 @@
+#include "file_prefetcher.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+
+FilePrefetcher::FilePrefetcher(const std::vector<std::string> &file_names, unsigned in_flight, size_t buffers)
+	: m_file_names(file_names)
+{
+	in_flight = std::max(1u, std::min<unsigned>(in_flight, std::max<size_t>(1, file_names.size())));
+
+	// Twice the reads in flight keeps the readers busy while consumers still hold the last batch
+	if (buffers < in_flight)
+		buffers = 2 * in_flight;
+
+	for (size_t i = 0; i < buffers; i++)
+	{
+		m_buffers.emplace_back(new std::vector<uint8_t>());
+		m_free_buffers.push_back(m_buffers.back().get());
+	}
+
+	for (unsigned i = 0; i < in_flight; i++)
+	{
+		m_readers.push_back(std::thread(&FilePrefetcher::reader_loop, this));
+	}
+}
+
+FilePrefetcher::~FilePrefetcher()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+	m_buffer_freed.notify_all();
+	m_file_ready.notify_all();
+
+	for (std::thread &th : m_readers)
+	{
+		th.join();
+	}
+}
+
+bool FilePrefetcher::next(PrefetchedFile &file)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_file_ready.wait(lock, [&]
+					  { return !m_ready.empty() || m_handed_out == m_file_names.size() || m_stopping; });
+
+	if (m_ready.empty())
+		return false;
+
+	file = m_ready.front();
+	m_ready.pop_front();
+	m_handed_out++;
+
+	// Wake the other consumers so they see the list is finished
+	if (m_handed_out == m_file_names.size())
+		m_file_ready.notify_all();
+	return true;
+}
+
+void FilePrefetcher::release(PrefetchedFile &file)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_free_buffers.push_back(file.data);
+	}
+	file.data = nullptr;
+	m_buffer_freed.notify_one();
+}
+
+bool FilePrefetcher::read_file(const std::string &file_name, std::vector<uint8_t> &data)
+{
+	data.clear();
+	const int fd = open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	struct stat info;
+	if (fstat(fd, &info) != 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	// One pread per file rather than seek, tell, seek and read through a stream
+	data.resize(info.st_size);
+	size_t done = 0;
+	while (done < data.size())
+	{
+		const ssize_t count = pread(fd, &data[done], data.size() - done, done);
+		if (count <= 0)
+			break;
+		done += count;
+	}
+
+	close(fd);
+	data.resize(done);
+	return done == (size_t)info.st_size;
+}
+
+void FilePrefetcher::reader_loop()
+{
+	for (;;)
+	{
+		size_t index;
+		std::vector<uint8_t> *buffer;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_buffer_freed.wait(lock, [&]
+								{ return !m_free_buffers.empty() || m_next_file == m_file_names.size() || m_stopping; });
+
+			if (m_stopping || m_next_file == m_file_names.size())
+				return;
+
+			index = m_next_file++;
+			buffer = m_free_buffers.back();
+			m_free_buffers.pop_back();
+		}
+
+		const bool ok = read_file(m_file_names[index], *buffer);
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_ready.push_back({index, buffer, ok});
+		}
+		m_file_ready.notify_one();
+	}
+}
@@ -2,7 +2,10 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <string.h>
+#include <stdio.h>
 #include <string>
+#include <unistd.h>
 
 std::vector<Img> load_csv(const char *_file_name)
 {
@@ -21,7 +24,7 @@ std::vector<Img> load_csv(const char *_file_name)
 			Matrix img_data = Matrix(8, 8);
 			// Matrix img_data = Matrix(9, 9);
 			bool label = atoi(word.c_str());
-			uint8_t x, y = 0;
+			uint8_t x = 0, y = 0;
 
 			while (getline(str, word, ','))
 			{
@@ -39,6 +42,128 @@ std::vector<Img> load_csv(const char *_file_name)
 	return imgs;
 }
 
+// Header "NNIM" + version, image count and shape, then per image a label byte and its entries
+bool save_imgs(const std::vector<Img> &_imgs, const char *_file_name)
+{
+	const std::string tmp_name = std::string(_file_name) + ".tmp";
+	FILE *file = fopen(tmp_name.c_str(), "wb");
+	if (!file)
+		return false;
+
+	const uint32_t version = 1, count = _imgs.size();
+	const uint16_t rows = _imgs.empty() ? 0 : _imgs[0].img_data.rows();
+	const uint16_t cols = _imgs.empty() ? 0 : _imgs[0].img_data.cols();
+	fwrite("NNIM", 1, 4, file);
+	fwrite(&version, sizeof(version), 1, file);
+	fwrite(&count, sizeof(count), 1, file);
+	fwrite(&rows, sizeof(rows), 1, file);
+	fwrite(&cols, sizeof(cols), 1, file);
+
+	for (const Img &img : _imgs)
+	{
+		const uint8_t label = img.label;
+		fwrite(&label, 1, 1, file);
+		for (int i = 0; i < rows; i++)
+		{
+			fwrite(&img.img_data.m_entries[i][0], sizeof(double), cols, file);
+		}
+	}
+
+	const bool written = !ferror(file);
+	fflush(file);
+	fsync(fileno(file));
+	fclose(file);
+
+	return written && rename(tmp_name.c_str(), _file_name) == 0;
+}
+
+std::vector<Img> load_imgs(const char *_file_name)
+{
+	std::vector<Img> imgs;
+	FILE *file = fopen(_file_name, "rb");
+	if (!file)
+		return imgs;
+
+	char magic[4];
+	uint32_t version = 0, count = 0;
+	uint16_t rows = 0, cols = 0;
+	if (fread(magic, 1, 4, file) != 4 || memcmp(magic, "NNIM", 4) != 0 || fread(&version, sizeof(version), 1, file) != 1 || version != 1 ||
+		fread(&count, sizeof(count), 1, file) != 1 || fread(&rows, sizeof(rows), 1, file) != 1 || fread(&cols, sizeof(cols), 1, file) != 1)
+	{
+		fclose(file);
+		return imgs;
+	}
+
+	// The count is only trusted as far as the file has room for that many images, so a
+	// damaged header can't make the reserve below, or a single Matrix, ask for gigabytes
+	const long header_end = ftell(file);
+	fseek(file, 0, SEEK_END);
+	const long file_end = ftell(file);
+	const uint64_t record_size = 1 + (uint64_t)rows * cols * sizeof(double);
+	if (header_end < 0 || file_end < header_end || fseek(file, header_end, SEEK_SET) != 0 || count > (uint64_t)(file_end - header_end) / record_size)
+	{
+		fclose(file);
+		return imgs;
+	}
+
+	imgs.reserve(count);
+	for (uint32_t n = 0; n < count; n++)
+	{
+		uint8_t label;
+		Matrix img_data(rows, cols);
+		bool complete = fread(&label, 1, 1, file) == 1;
+		for (int i = 0; i < rows && complete; i++)
+		{
+			complete = fread(&img_data.m_entries[i][0], sizeof(double), cols, file) == cols;
+		}
+
+		// A truncated cache is as good as no cache
+		if (!complete)
+		{
+			imgs.clear();
+			break;
+		}
+		imgs.push_back({img_data, label != 0});
+	}
+
+	fclose(file);
+	return imgs;
+}
+
+// Lays every image out as one column so a whole set can be fed forward at once
+Matrix stack_imgs(const std::vector<Img> &_imgs)
+{
+	if (_imgs.empty())
+		return Matrix();
+
+	const uint16_t img_rows = _imgs[0].img_data.rows();
+	const uint16_t img_cols = _imgs[0].img_data.cols();
+	Matrix stacked(img_rows * img_cols, _imgs.size());
+
+	for (size_t n = 0; n < _imgs.size(); n++)
+	{
+		for (int i = 0; i < img_rows; i++)
+		{
+			for (int j = 0; j < img_cols; j++)
+			{
+				stacked.m_entries[i * img_cols + j][n] = _imgs[n].img_data.m_entries[i][j];
+			}
+		}
+	}
+
+	return stacked;
+}
+
+std::vector<bool> stack_labels(const std::vector<Img> &_imgs)
+{
+	std::vector<bool> labels(_imgs.size());
+	for (size_t n = 0; n < _imgs.size(); n++)
+	{
+		labels[n] = _imgs[n].label;
+	}
+	return labels;
+}
+
 void Img::print() const
 {
 	img_data.print();
@@ -0,0 +1,476 @@
+#include "inference_server.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iterator>
+
+static const uint64_t listen_tag = 0;
+static const uint64_t event_tag = 1;
+
+InferenceServer::InferenceServer(const deployed_network_t &net, const ServerConfig &config, png_decoder_t png_decoder)
+	: m_net(net), m_config(config), m_png_decoder(png_decoder), m_stopping(false), m_requests(0), m_batches(0) {}
+
+InferenceServer::~InferenceServer()
+{
+	stop();
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_shutdown = true;
+	}
+	m_batch_ready.notify_all();
+	m_decode_ready.notify_all();
+	for (std::thread &th : m_workers)
+	{
+		th.join();
+	}
+
+	for (auto &connection : m_connections)
+	{
+		close(connection.second.fd);
+	}
+	if (m_listen_fd >= 0)
+	{
+		close(m_listen_fd);
+		unlink(m_config.socket_path.c_str());
+	}
+	if (m_epoll_fd >= 0)
+		close(m_epoll_fd);
+	if (m_event_fd >= 0)
+		close(m_event_fd);
+}
+
+bool InferenceServer::start()
+{
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (m_config.socket_path.empty() || m_config.socket_path.size() >= sizeof(address.sun_path))
+		return false;
+	strcpy(address.sun_path, m_config.socket_path.c_str());
+
+	m_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (m_listen_fd < 0)
+		return false;
+
+	// A socket file left behind by a previous run would make bind fail
+	unlink(m_config.socket_path.c_str());
+	if (bind(m_listen_fd, (sockaddr *)&address, sizeof(address)) != 0 || listen(m_listen_fd, SOMAXCONN) != 0)
+	{
+		printf("Could not listen on '%s': %s\n", m_config.socket_path.c_str(), strerror(errno));
+		close(m_listen_fd);
+		m_listen_fd = -1;
+		return false;
+	}
+
+	m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	m_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m_epoll_fd < 0 || m_event_fd < 0)
+		return false;
+
+	epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.u64 = listen_tag;
+	epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_listen_fd, &event);
+	event.data.u64 = event_tag;
+	epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_event_fd, &event);
+
+	m_workers.push_back(std::thread(&InferenceServer::batcher_loop, this));
+	for (unsigned i = 0; m_png_decoder && i < std::max(1u, m_config.decoders); i++)
+	{
+		m_workers.push_back(std::thread(&InferenceServer::decoder_loop, this));
+	}
+	return true;
+}
+
+void InferenceServer::stop()
+{
+	m_stopping = true;
+	if (m_event_fd >= 0)
+	{
+		const uint64_t one = 1;
+		ssize_t written = write(m_event_fd, &one, sizeof(one));
+		(void)written;
+	}
+}
+
+void InferenceServer::run()
+{
+	epoll_event events[64];
+	while (!m_stopping)
+	{
+		const int n_events = epoll_wait(m_epoll_fd, events, 64, -1);
+		if (n_events < 0 && errno != EINTR)
+			break;
+
+		for (int i = 0; i < n_events; i++)
+		{
+			const uint64_t tag = events[i].data.u64;
+			if (tag == listen_tag)
+			{
+				accept_connections();
+				continue;
+			}
+			if (tag == event_tag)
+			{
+				uint64_t count;
+				while (read(m_event_fd, &count, sizeof(count)) > 0)
+				{
+				}
+				deliver_replies();
+				continue;
+			}
+
+			auto found = m_connections.find(tag);
+			if (found == m_connections.end())
+				continue;
+
+			// EPOLLHUP means the client can no longer read either, so there is nobody to answer
+			Connection &connection = found->second;
+			bool open = !(events[i].events & (EPOLLERR | EPOLLHUP));
+			if (open && (events[i].events & EPOLLIN))
+				open = read_connection(tag, connection);
+			if (open && (events[i].events & EPOLLOUT))
+				open = flush_connection(tag, connection);
+			if (!open || finished(connection))
+				close_connection(tag);
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_shutdown = true;
+	}
+	m_batch_ready.notify_all();
+	m_decode_ready.notify_all();
+}
+
+void InferenceServer::accept_connections()
+{
+	for (;;)
+	{
+		const int fd = accept4(m_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+			return;
+
+		const uint64_t id = m_next_connection++;
+		m_connections[id].fd = fd;
+
+		epoll_event event = {};
+		event.events = EPOLLIN | EPOLLRDHUP;
+		event.data.u64 = id;
+		epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &event);
+	}
+}
+
+bool InferenceServer::read_connection(uint64_t id, Connection &connection)
+{
+	uint8_t buffer[1 << 16];
+	for (;;)
+	{
+		const ssize_t count = read(connection.fd, buffer, sizeof(buffer));
+		if (count > 0)
+		{
+			connection.in.insert(connection.in.end(), buffer, buffer + count);
+			continue;
+		}
+		if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (count < 0 && errno == EINTR)
+			continue;
+		if (count < 0)
+			return false;
+
+		// End of stream. The client may only have shut down its sending side, so everything
+		// already read is still answered and the connection closes once the replies are out
+		connection.read_closed = true;
+		break;
+	}
+	return parse_requests(id, connection);
+}
+
+bool InferenceServer::parse_requests(uint64_t id, Connection &connection)
+{
+	size_t offset = 0;
+	std::vector<Job> raw_jobs;
+	std::vector<Job> png_jobs;
+	const clock_t::time_point now = clock_t::now();
+
+	while (connection.in.size() - offset >= sizeof(InferenceRequestHeader))
+	{
+		InferenceRequestHeader header;
+		memcpy(&header, &connection.in[offset], sizeof(header));
+
+		// There is no way to find the next frame after a bad length, so give up on the stream
+		if (header.size > m_config.max_payload)
+			return false;
+		if (connection.in.size() - offset - sizeof(header) < header.size)
+			break;
+
+		const uint8_t *payload = &connection.in[offset + sizeof(header)];
+		offset += sizeof(header) + header.size;
+		m_requests++;
+
+		Job job;
+		job.connection = id;
+		job.id = header.id;
+		job.arrival = now;
+
+		if (header.format == RawPixels && header.size == job.pixels.size())
+		{
+			std::copy(payload, payload + header.size, job.pixels.begin());
+			raw_jobs.push_back(std::move(job));
+		}
+		else if (header.format == PngFrame && m_png_decoder)
+		{
+			job.png.assign(payload, payload + header.size);
+			png_jobs.push_back(std::move(job));
+		}
+		else
+		{
+			const bool png = header.format == PngFrame;
+			send_reply(connection, {header.id, png ? Unsupported : BadRequest, 0, 0});
+		}
+	}
+	connection.in.erase(connection.in.begin(), connection.in.begin() + offset);
+	connection.in_flight += raw_jobs.size() + png_jobs.size();
+
+	if (!raw_jobs.empty() || !png_jobs.empty())
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			std::move(raw_jobs.begin(), raw_jobs.end(), std::back_inserter(m_pending));
+			std::move(png_jobs.begin(), png_jobs.end(), std::back_inserter(m_decode_jobs));
+		}
+		if (!raw_jobs.empty())
+			m_batch_ready.notify_one();
+		if (!png_jobs.empty())
+			m_decode_ready.notify_all();
+	}
+	return flush_connection(id, connection);
+}
+
+void InferenceServer::send_reply(Connection &connection, const InferenceResponse &response)
+{
+	const uint8_t *bytes = (const uint8_t *)&response;
+	connection.out.insert(connection.out.end(), bytes, bytes + sizeof(response));
+}
+
+bool InferenceServer::flush_connection(uint64_t id, Connection &connection)
+{
+	size_t sent = 0;
+	while (sent < connection.out.size())
+	{
+		const ssize_t count = send(connection.fd, &connection.out[sent], connection.out.size() - sent, MSG_NOSIGNAL);
+		if (count > 0)
+		{
+			sent += count;
+			continue;
+		}
+		if (count < 0 && errno == EINTR)
+			continue;
+		if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		return false;
+	}
+	connection.out.erase(connection.out.begin(), connection.out.begin() + sent);
+
+	// Only ask for EPOLLOUT while there is something waiting, and stop asking for input once
+	// the client has finished sending, otherwise either fires constantly
+	const bool writing = !connection.out.empty();
+	if (writing != connection.writing || connection.read_closed)
+	{
+		epoll_event event = {};
+		event.events = (connection.read_closed ? 0 : EPOLLIN | EPOLLRDHUP) | (writing ? EPOLLOUT : 0);
+		event.data.u64 = id;
+		epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, connection.fd, &event);
+		connection.writing = writing;
+	}
+	return true;
+}
+
+void InferenceServer::close_connection(uint64_t id)
+{
+	auto found = m_connections.find(id);
+	if (found == m_connections.end())
+		return;
+
+	epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, found->second.fd, nullptr);
+	close(found->second.fd);
+	m_connections.erase(found);
+}
+
+void InferenceServer::deliver_replies()
+{
+	std::vector<Reply> replies;
+	{
+		std::lock_guard<std::mutex> lock(m_reply_mutex);
+		replies.swap(m_replies);
+	}
+
+	// Group by connection so each one gets a single send per wakeup
+	std::vector<uint64_t> touched;
+	for (const Reply &reply : replies)
+	{
+		auto found = m_connections.find(reply.connection);
+		if (found == m_connections.end())
+			continue;
+		if (found->second.out.empty())
+			touched.push_back(reply.connection);
+		send_reply(found->second, reply.response);
+		found->second.in_flight--;
+	}
+
+	for (uint64_t id : touched)
+	{
+		auto found = m_connections.find(id);
+		if (found == m_connections.end() || found->second.writing)
+			continue;
+		if (!flush_connection(id, found->second) || finished(found->second))
+			close_connection(id);
+	}
+}
+
+// Called from worker threads, hands replies to the epoll thread and wakes it
+void InferenceServer::post_replies(std::vector<Reply> &replies)
+{
+	if (replies.empty())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(m_reply_mutex);
+		m_replies.insert(m_replies.end(), replies.begin(), replies.end());
+	}
+	replies.clear();
+
+	const uint64_t one = 1;
+	ssize_t written = write(m_event_fd, &one, sizeof(one));
+	(void)written;
+}
+
+// Pixels are scaled the way to_img scales them for the datasets
+InferenceResponse InferenceServer::classify(const deployed_network_t &net, uint32_t id, const uint8_t *pixels)
+{
+	std::array<double, deployed_network_t::inputs> features;
+	std::array<double, deployed_network_t::outputs> output;
+	for (size_t i = 0; i < features.size(); i++)
+	{
+		features[i] = pixels[i] / 256.0;
+	}
+
+	net.forward(features.data(), output);
+	const uint8_t label = output[1] > output[0];
+	return {id, InferenceOk, label, (float)output[1]};
+}
+
+void InferenceServer::batcher_loop()
+{
+	std::vector<Job> batch;
+	std::vector<Reply> replies;
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	for (;;)
+	{
+		m_batch_ready.wait(lock, [&]
+						   { return !m_pending.empty() || m_shutdown; });
+		if (m_shutdown)
+			return;
+
+		// Hold the oldest request until the batch fills or it has waited long enough
+		const clock_t::time_point deadline = m_pending.front().arrival + std::chrono::microseconds(m_config.max_delay_us);
+		m_batch_ready.wait_until(lock, deadline, [&]
+								 { return m_pending.size() >= m_config.max_batch || m_shutdown; });
+		if (m_shutdown)
+			return;
+
+		const size_t n_jobs = std::min<size_t>(m_pending.size(), std::max(1u, m_config.max_batch));
+		batch.clear();
+		std::move(m_pending.begin(), m_pending.begin() + n_jobs, std::back_inserter(batch));
+		m_pending.erase(m_pending.begin(), m_pending.begin() + n_jobs);
+		lock.unlock();
+
+		for (const Job &job : batch)
+		{
+			replies.push_back({job.connection, classify(m_net, job.id, job.pixels.data())});
+		}
+		m_batches++;
+		post_replies(replies);
+
+		lock.lock();
+	}
+}
+
+void InferenceServer::decoder_loop()
+{
+	std::vector<Reply> replies;
+	for (;;)
+	{
+		Job job;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_decode_ready.wait(lock, [&]
+								{ return !m_decode_jobs.empty() || m_shutdown; });
+			if (m_shutdown)
+				return;
+
+			job = std::move(m_decode_jobs.front());
+			m_decode_jobs.pop_front();
+		}
+
+		if (!m_png_decoder(job.png, job.pixels.data()))
+		{
+			replies.push_back({job.connection, {job.id, DecodeFailed, 0, 0}});
+			post_replies(replies);
+			continue;
+		}
+
+		// Decoding took a while, so the batching deadline starts from now rather than arrival
+		job.png.clear();
+		job.arrival = clock_t::now();
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_pending.push_back(std::move(job));
+		}
+		m_batch_ready.notify_one();
+	}
+}
+
+ShmClassifier::ShmClassifier(const deployed_network_t &net, ShmRing &frames, ShmRing &results, InferenceServer::png_decoder_t png_decoder)
+	: m_net(net), m_frame_ring(frames), m_result_ring(results), m_png_decoder(png_decoder), m_frames(0) {}
+
+void ShmClassifier::run()
+{
+	std::array<uint8_t, deployed_network_t::inputs> pixels;
+	std::vector<uint8_t> png;
+
+	while (const ShmSlot *frame = m_frame_ring.begin_read())
+	{
+		InferenceResponse response = {frame->id, BadRequest, 0, 0};
+		if (frame->format == RawPixels && frame->size == pixels.size())
+			response = InferenceServer::classify(m_net, frame->id, frame->data);
+		else if (frame->format == PngFrame && !m_png_decoder)
+			response.status = Unsupported;
+		else if (frame->format == PngFrame && frame->size <= m_frame_ring.slot_size())
+		{
+			// The decoder wants a vector, this is the one copy on the PNG path
+			png.assign(frame->data, frame->data + frame->size);
+			if (m_png_decoder(png, pixels.data()))
+				response = InferenceServer::classify(m_net, frame->id, pixels.data());
+			else
+				response.status = DecodeFailed;
+		}
+		m_frame_ring.end_read();
+
+		uint8_t *slot = m_result_ring.begin_write();
+		if (!slot)
+			return;
+		memcpy(slot, &response, sizeof(response));
+		m_result_ring.end_write(response.id, InferenceOk, sizeof(response));
+		m_frames++;
+	}
+}
@@ -4,7 +4,6 @@
 #include <chrono>
 #include <algorithm>
 #include <numeric>
-#include <random>
 #include <iomanip>
 #include <stdlib.h>
 #include <time.h>
@@ -12,12 +11,23 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <string.h>
-#include <mutex>
+#include <getopt.h>
+#include <errno.h>
 #include <thread>
+#include <memory>
+#include <functional>
+#include <signal.h>
+#include <atomic>
+#include <limits>
 
 #include "img.h"
 #include "matrix.h"
 #include "nn.h"
+#include "static_network.h"
+#include "sparse_network.h"
+#include "inference_server.h"
+#include "results_sink.h"
+#include "thread_pool.h"
 #include "preprocess.h"
 #include "lodepng.h"
 
@@ -25,142 +35,724 @@ using preprocess::flat_image_t;
 using preprocess::image_t;
 using preprocess::PartType;
 
-// #define PROCESSING
-#define TRAINING
-// #define TUNING
-#define TESTING
+struct options_t
+{
+	// Paths, anything left empty is derived from data_dir
+	std::string data_dir = "../data";
+	std::string images_dir;
+	std::string train_file;
+	std::string validation_file;
+	std::string feature_cache_file;
+	std::string network_dir;
+	bool network_given = false; // train only saves when --network names where to
+	std::string pruned_dir; // prune: where the pruned network goes, not saved when empty
+	std::string scores_dir;
+	std::string socket_path = "/tmp/nn_inference.sock";
+	bool binary = false;   // .bin image sets instead of the CSVs
+	bool use_cache = true; // Feature cache during preprocess
+
+	unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+	unsigned loaders = 0;
+	std::string dtype = "f64";
+	const Activation *activation = &default_activation();
+
+	uint16_t hidden = 200;
+	uint16_t epochs = 60;
+	uint16_t batch_size = 1;
+	double learning_rate = 0.15;
+	uint64_t seed = 42;
+	uint16_t eta = 3;
+	bool evaluate = false; // train: score the validation set before exiting
+	bool quiet = false;	   // eval: no per image output
+	double sparsity = 0.5; // prune: fraction of hidden weights zeroed
+
+	bool shm = false;
+	unsigned stations = 2;
+	uint32_t max_batch = 64;
+	uint32_t max_delay_us = 1000;
+};
 
-const char *files[] = {
-	"../data/processed images/training_data.csv",
-	"../data/processed images/validation_data.csv"
+SearchSpace search_space = {
+	{200, 250, 300, 350},	// Hidden nodes
+	{1},					// Batch sizes
+	0.05, 0.15,				// Learning rate range
+	5, 125					// Epoch range
 };
 
-std::vector<int> epoch_sizes =        {60, 85, 100, 125};
-std::vector<int> hidden_nodes_sizes = {200, 250, 300, 350};
-std::vector<double> learning_rates =  {0.05, 0.08, 0.12, 0.15};
+const char *usage =
+	"Usage: NN <command> [options]\n"
+	"\n"
+	"Commands:\n"
+	"  preprocess   Condense the PNGs in --images into the training and validation sets\n"
+	"  train        Train a network, saving it only when --network is given\n"
+	"  tune         Hyperband search over the built in search space\n"
+	"  eval         Score the network in --network on the validation set\n"
+	"  prune        Prune --network and compare sparse and dense inference on the validation set\n"
+	"  bench        Time training, inference and the activation variants\n"
+	"  serve        Serve --network on a Unix socket, or over shared memory with --shm\n"
+	"\n"
+	"Paths:\n"
+	"  --data DIR             Root the other paths default into (../data)\n"
+	"  --images DIR           Source PNGs (DATA/images)\n"
+	"  --train-set FILE       Training set (DATA/processed images/training_data.csv|.bin)\n"
+	"  --validation-set FILE  Validation set (DATA/processed images/validation_data.csv|.bin)\n"
+	"  --feature-cache FILE   Condensed feature cache (DATA/processed images/features.cache)\n"
+	"  --network DIR          Checkpoint directory (DATA/network)\n"
+	"  --pruned DIR           Where prune saves the pruned network (not saved)\n"
+	"  --scores DIR           Tuning output (DATA/scores)\n"
+	"  --socket PATH          Unix socket for serve (/tmp/nn_inference.sock)\n"
+	"  --binary               Use the binary image sets instead of the CSVs\n"
+	"  --no-cache             Preprocess every frame even if the feature cache has it\n"
+	"\n"
+	"Execution:\n"
+	"  --threads N            Worker threads, and cores matrix operations may split over (all cores)\n"
+	"  --loaders N            Threads assembling mini-batches while training (0)\n"
+	"  --dtype TYPE           Numeric type, only f64 is implemented (f64)\n"
+	"\n"
+	"Model:\n"
+	"  --hidden N             Hidden nodes (200)\n"
+	"  --activation NAME      sigmoid or tanh, optionally -poly or -lut for the approximations (sigmoid)\n"
+	"  --epochs N             Training epochs (60)\n"
+	"  --batch-size N         Learning rate divisor, weights still update after every sample, 0 for the set size (1)\n"
+	"  --lr X                 Learning rate (0.15)\n"
+	"  --seed N               Seed for weights and shuffling (42)\n"
+	"  --eta N                Hyperband halving rate (3)\n"
+	"  --eval                 train: score the validation set before exiting\n"
+	"  --quiet                eval: print only the score\n"
+	"  --sparsity X           prune: fraction of hidden weights to zero (0.5)\n"
+	"\n"
+	"Serving:\n"
+	"  --shm                  Serve over /nn_frames_N and /nn_results_N shared memory rings\n"
+	"  --stations N           Shared memory stations (2)\n"
+	"  --max-batch N          Requests scored together (64)\n"
+	"  --max-delay-us N       Longest a request waits for a batch to fill (1000)\n";
 
-struct hyperparameters
+enum option_id_t
 {
-	uint16_t hidden_nodes;
-	double learning_rate;
+	DataOpt = 256,
+	ImagesOpt,
+	TrainSetOpt,
+	ValidationSetOpt,
+	FeatureCacheOpt,
+	NetworkOpt,
+	PrunedOpt,
+	ScoresOpt,
+	SocketOpt,
+	BinaryOpt,
+	NoCacheOpt,
+	ThreadsOpt,
+	LoadersOpt,
+	DtypeOpt,
+	HiddenOpt,
+	ActivationOpt,
+	EpochsOpt,
+	BatchSizeOpt,
+	LearningRateOpt,
+	SeedOpt,
+	EtaOpt,
+	EvalOpt,
+	QuietOpt,
+	SparsityOpt,
+	ShmOpt,
+	StationsOpt,
+	MaxBatchOpt,
+	MaxDelayOpt,
+	HelpOpt
 };
 
-std::mutex file_mutex;
-std::vector<Img> train_imgs, test_imgs;
-std::vector<hyperparameters> possible_hp_combos;
-std::vector<std::thread> threads;
-
-void save_score(const double score, const uint16_t current_epoch, const hyperparameters& params)
-{
-	file_mutex.lock();	
-	std::cout << "Trained Network - Epochs : " << current_epoch << " Hidden Nodes : " << params.hidden_nodes << " Learning Rate : " << params.learning_rate << std::endl;
-	chdir("../data/scores");
-	FILE *score_matrix = fopen("score_matrix.csv", "a");
-	fprintf(score_matrix, "%1.5f, ", score);
-	fprintf(score_matrix, "%d, ", params.hidden_nodes);
-	fprintf(score_matrix, "%d, ", current_epoch);
-	fprintf(score_matrix, "%1.5f\n", params.learning_rate);
-	fclose(score_matrix);
-	file_mutex.unlock();
+const option long_options[] = {
+	{"data", required_argument, nullptr, DataOpt},
+	{"images", required_argument, nullptr, ImagesOpt},
+	{"train-set", required_argument, nullptr, TrainSetOpt},
+	{"validation-set", required_argument, nullptr, ValidationSetOpt},
+	{"feature-cache", required_argument, nullptr, FeatureCacheOpt},
+	{"network", required_argument, nullptr, NetworkOpt},
+	{"pruned", required_argument, nullptr, PrunedOpt},
+	{"scores", required_argument, nullptr, ScoresOpt},
+	{"socket", required_argument, nullptr, SocketOpt},
+	{"binary", no_argument, nullptr, BinaryOpt},
+	{"no-cache", no_argument, nullptr, NoCacheOpt},
+	{"threads", required_argument, nullptr, ThreadsOpt},
+	{"loaders", required_argument, nullptr, LoadersOpt},
+	{"dtype", required_argument, nullptr, DtypeOpt},
+	{"hidden", required_argument, nullptr, HiddenOpt},
+	{"activation", required_argument, nullptr, ActivationOpt},
+	{"epochs", required_argument, nullptr, EpochsOpt},
+	{"batch-size", required_argument, nullptr, BatchSizeOpt},
+	{"lr", required_argument, nullptr, LearningRateOpt},
+	{"seed", required_argument, nullptr, SeedOpt},
+	{"eta", required_argument, nullptr, EtaOpt},
+	{"eval", no_argument, nullptr, EvalOpt},
+	{"quiet", no_argument, nullptr, QuietOpt},
+	{"sparsity", required_argument, nullptr, SparsityOpt},
+	{"shm", no_argument, nullptr, ShmOpt},
+	{"stations", required_argument, nullptr, StationsOpt},
+	{"max-batch", required_argument, nullptr, MaxBatchOpt},
+	{"max-delay-us", required_argument, nullptr, MaxDelayOpt},
+	{"help", no_argument, nullptr, HelpOpt},
+	{nullptr, 0, nullptr, 0}};
+
+// Whole non-negative number within max, false for anything else
+bool parse_number(const char *text, uint64_t max, uint64_t &value)
+{
+	char *end;
+	errno = 0;
+	const unsigned long long parsed = strtoull(text, &end, 10);
+	if (errno || end == text || *end || text[0] == '-' || parsed > max)
+		return false;
+	value = parsed;
+	return true;
+}
+
+template <typename T>
+bool parse_number(const char *text, T &value)
+{
+	uint64_t parsed;
+	if (!parse_number(text, std::numeric_limits<T>::max(), parsed))
+		return false;
+	value = parsed;
+	return true;
 }
 
-void train_and_save(const hyperparameters& params)
+bool parse_options(int argc, char *argv[], options_t &opts)
 {
-	NeuralNetwork net = NeuralNetwork(64, params.hidden_nodes, 2);
-	for (int i = 0; i < epoch_sizes[3] + 1; i++)
+	opterr = 0;
+	for (;;)
 	{
-		net.train_model(train_imgs, 1, 1, params.learning_rate);
-		for (int saved_epoch : epoch_sizes)
+		const int option_index = optind;
+		const int id = getopt_long(argc, argv, "", long_options, nullptr);
+		if (id == -1)
+			break;
+
+		bool ok = true;
+		switch (id)
+		{
+		case DataOpt: opts.data_dir = optarg; break;
+		case ImagesOpt: opts.images_dir = optarg; break;
+		case TrainSetOpt: opts.train_file = optarg; break;
+		case ValidationSetOpt: opts.validation_file = optarg; break;
+		case FeatureCacheOpt: opts.feature_cache_file = optarg; break;
+		case NetworkOpt:
+			opts.network_dir = optarg;
+			opts.network_given = true;
+			break;
+		case PrunedOpt: opts.pruned_dir = optarg; break;
+		case ScoresOpt: opts.scores_dir = optarg; break;
+		case SocketOpt: opts.socket_path = optarg; break;
+		case BinaryOpt: opts.binary = true; break;
+		case NoCacheOpt: opts.use_cache = false; break;
+		case ThreadsOpt: ok = parse_number(optarg, opts.threads) && opts.threads > 0; break;
+		case LoadersOpt: ok = parse_number(optarg, opts.loaders); break;
+		case DtypeOpt: opts.dtype = optarg; break;
+		case HiddenOpt: ok = parse_number(optarg, opts.hidden) && opts.hidden > 0; break;
+		case ActivationOpt: ok = (opts.activation = find_activation(optarg)) != nullptr; break;
+		case EpochsOpt: ok = parse_number(optarg, opts.epochs); break;
+		case BatchSizeOpt: ok = parse_number(optarg, opts.batch_size); break;
+		case LearningRateOpt:
 		{
-			if (i == saved_epoch)
-			{
-				double score = net.predict_batch_imgs(test_imgs);
-				save_score(score, i, params);
-			}
+			char *end;
+			opts.learning_rate = strtod(optarg, &end);
+			ok = end != optarg && !*end && opts.learning_rate > 0;
+			break;
+		}
+		case SeedOpt: ok = parse_number(optarg, opts.seed); break;
+		case EtaOpt: ok = parse_number(optarg, opts.eta) && opts.eta >= 2; break;
+		case EvalOpt: opts.evaluate = true; break;
+		case QuietOpt: opts.quiet = true; break;
+		case SparsityOpt:
+		{
+			char *end;
+			opts.sparsity = strtod(optarg, &end);
+			ok = end != optarg && !*end && opts.sparsity >= 0 && opts.sparsity <= 1;
+			break;
+		}
+		case ShmOpt: opts.shm = true; break;
+		case StationsOpt: ok = parse_number(optarg, opts.stations) && opts.stations > 0; break;
+		case MaxBatchOpt: ok = parse_number(optarg, opts.max_batch) && opts.max_batch > 0; break;
+		case MaxDelayOpt: ok = parse_number(optarg, opts.max_delay_us); break;
+		case HelpOpt: printf("%s", usage); exit(0);
+		default:
+			printf("Unknown option '%s'\n", argv[option_index]);
+			return false;
 		}
+
+		if (!ok)
+		{
+			printf("Invalid value '%s' for '%s'\n", optarg, argv[option_index]);
+			return false;
+		}
+	}
+
+	if (optind < argc)
+	{
+		printf("Unexpected argument '%s'\n", argv[optind]);
+		return false;
+	}
+
+	// Everything runs in double precision, so accept the spellings of that and nothing else
+	if (opts.dtype != "f64" && opts.dtype != "float64" && opts.dtype != "double")
+	{
+		printf("Unsupported dtype '%s', only f64 is implemented\n", opts.dtype.c_str());
+		return false;
 	}
-	
+
+	const std::string processed_dir = opts.data_dir + "/processed images/";
+	const char *extension = opts.binary ? ".bin" : ".csv";
+	if (opts.images_dir.empty())
+		opts.images_dir = opts.data_dir + "/images";
+	if (opts.train_file.empty())
+		opts.train_file = processed_dir + "training_data" + extension;
+	if (opts.validation_file.empty())
+		opts.validation_file = processed_dir + "validation_data" + extension;
+	if (opts.feature_cache_file.empty())
+		opts.feature_cache_file = processed_dir + "features.cache";
+	if (opts.network_dir.empty())
+		opts.network_dir = opts.data_dir + "/network";
+	if (opts.scores_dir.empty())
+		opts.scores_dir = opts.data_dir + "/scores";
+	return true;
 }
 
-void populate_hp_combos(int idx)
+std::vector<Img> load_set(const options_t &opts, const std::string &file_name)
 {
-	if (idx == 0x10) return;
-	hyperparameters hp = { hidden_nodes_sizes[(idx & 0xC) >> 0x2], learning_rates[idx & 0x3] };
-	possible_hp_combos.push_back(hp);
-	populate_hp_combos(++idx);
+	std::vector<Img> imgs = opts.binary ? load_imgs(file_name.c_str()) : load_csv(file_name.c_str());
+	if (imgs.empty())
+		printf("No images in '%s'\n", file_name.c_str());
+	return imgs;
 }
 
-int main(int argc, char *argv[])
+int stop_pipe[2] = {-1, -1};
+
+void request_stop(int)
 {
+	const int saved_errno = errno;
+	const char byte = 0;
+	if (write(stop_pipe[1], &byte, 1) < 0)
+	{
+		// A full pipe already holds a stop request
+	}
+	errno = saved_errno;
+}
+
+// Calls on_stop from an ordinary thread once SIGINT or SIGTERM arrives. The handlers only
+// write to a pipe, so they never touch anything the serving code may be building or tearing
+// down. Install it once everything on_stop uses exists
+class StopSignal
+{
+public:
+	StopSignal(std::function<void()> on_stop)
+	{
+		if (pipe(stop_pipe) != 0)
+			return;
+		m_watcher = std::thread([this, on_stop]
+								{
+									char byte;
+									while (read(stop_pipe[0], &byte, 1) < 0 && errno == EINTR)
+										;
+									if (!m_done)
+										on_stop(); });
+		signal(SIGINT, request_stop);
+		signal(SIGTERM, request_stop);
+	}
 
-#ifdef PROCESSING
+	~StopSignal()
+	{
+		if (!m_watcher.joinable())
+			return;
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+		m_done = true;
+		request_stop(0);
+		m_watcher.join();
+		close(stop_pipe[0]);
+		close(stop_pipe[1]);
+		stop_pipe[0] = stop_pipe[1] = -1;
+	}
+
+private:
+	std::atomic<bool> m_done{false};
+	std::thread m_watcher;
+};
+
+int run_preprocess(const options_t &opts)
+{
 	std::vector<uint16_t> index_list(DATASET_SIZE);
 	std::iota(index_list.begin(), index_list.end(), 1);
 
-	unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-	std::default_random_engine random_engine(seed);
-	std::shuffle(index_list.begin(), index_list.end(), random_engine);
+	Rng shuffle_rng = Rng::stream(opts.seed, 0, Shuffle);
+	shuffle_rng.shuffle(index_list);
+
+	std::vector<std::string> in_filenames;
+	for (size_t i = 0; i < DATASET_SIZE; i++)
+	{
+		in_filenames.push_back(opts.images_dir + "/" + std::to_string(index_list[i]) + ".PNG");
+	}
+
+	std::vector<image_t> condensed;
+	std::unique_ptr<FeatureCache> feature_cache(opts.use_cache ? new FeatureCache(opts.feature_cache_file) : nullptr);
+	preprocess::condense_files(in_filenames, condensed, opts.threads, feature_cache.get());
+	if (feature_cache)
+	{
+		printf("Feature cache: %zu reused, %zu processed\n", feature_cache->hits(), feature_cache->misses());
+		feature_cache->save();
+	}
+
+	const std::string out_files[] = {opts.train_file, opts.validation_file};
+	std::vector<Img> processed[2];
+	if (!opts.binary)
+	{
+		const char *csv_files[] = {out_files[Training].c_str(), out_files[Validation].c_str()};
+		preprocess::clear_files(csv_files, 2);
+	}
+
+	for (size_t i = 0; i < DATASET_SIZE; i++)
+	{
+		const int split = ((i + 1) <= TRAIN_SIZE) ? Training : Validation;
+		const PartType part_type = (index_list[i] <= 400) ? PartType::BadPart : PartType::GoodPart;
+
+		std::cout << std::setw(3) << i + 1 << " - Saving Part " << std::setw(3) << index_list[i] << " As A " << (part_type ? "Good Part" : " Bad Part") << " Into " << out_files[split] << std::endl;
+
+		if (!condensed[i].size.width)
+			continue;
+		if (opts.binary)
+			processed[split].push_back(preprocess::to_img(condensed[i], part_type));
+		else
+			preprocess::save_to_file(condensed[i], out_files[split].c_str(), part_type);
+	}
+
+	if (opts.binary && (!save_imgs(processed[Training], out_files[Training].c_str()) || !save_imgs(processed[Validation], out_files[Validation].c_str())))
+	{
+		printf("Could not write the image sets\n");
+		return 1;
+	}
+	return 0;
+}
+
+int run_train(const options_t &opts)
+{
+	std::vector<Img> imgs = load_set(opts, opts.train_file);
+	if (imgs.empty())
+		return 1;
+
+	Dataset train_set(imgs);
+	NeuralNetwork net = NeuralNetwork(train_set.features(), opts.hidden, 2, opts.seed);
+	net.set_loaders(opts.loaders);
+	net.set_activation(*opts.activation);
+	net.train_model(train_set, opts.epochs, opts.batch_size, opts.learning_rate);
+	// The default checkpoint is the tracked one eval and serve read, so it is never overwritten implicitly
+	if (opts.network_given && !net.save(opts.network_dir))
+		return 1;
+
+	if (opts.evaluate)
+	{
+		std::vector<Img> validation_imgs = load_set(opts, opts.validation_file);
+		printf("Score: %1.5f\n", net.score_batch(stack_imgs(validation_imgs), stack_labels(validation_imgs)));
+	}
+	return 0;
+}
+
+int run_tune(const options_t &opts)
+{
+	Dataset train_set(load_set(opts, opts.train_file));
+	std::vector<Img> test_imgs = load_set(opts, opts.validation_file);
+	if (!train_set.size() || test_imgs.empty())
+		return 1;
+
+	mkdir(opts.scores_dir.c_str(), 0777);
+	ResultsSink score_sink(opts.scores_dir + "/score_matrix.csv", SinkFormat::Csv);
+	Tuner tuner(search_space, train_set, test_imgs, opts.threads, opts.seed);
+	tuner.set_on_result([&](const TrialResult &result)
+						{ score_sink.push(result); });
+
+	std::vector<TrialResult> best = tuner.hyperband(opts.eta);
+	score_sink.close();
+	tuner.save_results(opts.scores_dir + "/search_results.csv");
+
+	printf("Best Score: %1.5f Hidden Nodes: %d Epochs: %d Learning Rate: %1.5f\n", best[0].score,
+		   best[0].params.hidden_nodes, best[0].params.epochs, best[0].params.learning_rate);
+	return 0;
+}
+
+int run_eval(const options_t &opts)
+{
+	if (access((opts.network_dir + "/descriptor").c_str(), R_OK) != 0)
+	{
+		printf("No network saved in '%s'\n", opts.network_dir.c_str());
+		return 1;
+	}
+
+	std::vector<Img> imgs = load_set(opts, opts.validation_file);
+	if (imgs.empty())
+		return 1;
+
+	NeuralNetwork net(opts.network_dir);
+	const double score = opts.quiet ? net.score_batch(stack_imgs(imgs), stack_labels(imgs)) : net.predict_batch_imgs(imgs);
+	printf("Score: %1.5f\n", score);
+
+	// The deployed shape, scored through the fixed size kernels
+	std::unique_ptr<deployed_network_t> deployed(new deployed_network_t());
+	if (deployed->load(net))
+		printf("Static Network Score: %1.5f\n", deployed->score(Dataset(imgs)));
+	return 0;
+}
+
+double elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int run_bench(const options_t &opts)
+{
+	std::vector<Img> imgs = load_set(opts, opts.train_file);
+	std::vector<Img> validation_imgs = load_set(opts, opts.validation_file);
+	if (imgs.empty() || validation_imgs.empty())
+		return 1;
+
+	Dataset train_set(imgs);
+	Dataset validation_set(validation_imgs);
+	NeuralNetwork net(train_set.features(), opts.hidden, 2, opts.seed);
+	net.set_loaders(opts.loaders);
+	net.set_activation(*opts.activation);
+
+	// The first epoch sizes the scratch arenas, alloc_test checks that later ones leave malloc alone
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	net.train_model(train_set, 1, opts.batch_size, opts.learning_rate);
+	const double cold_ms = elapsed_ms(start);
+
+	const uint16_t warm_epochs = std::max<uint16_t>(1, opts.epochs);
+	start = std::chrono::steady_clock::now();
+	net.train_model(train_set, warm_epochs, opts.batch_size, opts.learning_rate);
+	const double warm_ms = elapsed_ms(start) / warm_epochs;
+
+	printf("Training: first epoch %.2f ms, warm epochs %.2f ms each\n", cold_ms, warm_ms);
+
+	const Matrix inputs = stack_imgs(validation_imgs);
+	const std::vector<bool> labels = stack_labels(validation_imgs);
+	const int passes = 100;
+	double score = 0;
 
-	std::string in_filename, out_filename;
-	PartType part_type;
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < passes; i++)
+	{
+		score = net.score_batch(inputs, labels);
+	}
+	const double dynamic_us = elapsed_ms(start) * 1000 / passes / validation_set.size();
+	printf("Inference: dynamic %.3f us per sample (score %1.5f)\n", dynamic_us, score);
 
-	preprocess::clear_files(files, 2);
+	std::unique_ptr<deployed_network_t> deployed(new deployed_network_t());
+	if (deployed->load(net))
+	{
+		start = std::chrono::steady_clock::now();
+		for (int i = 0; i < passes; i++)
+		{
+			score = deployed->score(validation_set);
+		}
+		const double static_us = elapsed_ms(start) * 1000 / passes / validation_set.size();
+		printf("Inference: static %.3f us per sample (score %1.5f)\n", static_us, score);
+	}
 
-	for (size_t i = 0; i <= DATASET_SIZE; i++)
+	// The trained weights scored through every variant of their activation, against the
+	// exact function over the range pre-activations actually reach
+	const std::string family = std::string(net.m_activation->name).substr(0, std::string(net.m_activation->name).find('-'));
+	const Activation &exact = *find_activation(family);
+	const int n_points = 1 << 20;
+	for (const Activation &activation : activations())
 	{
-		in_filename = "../data/images/" + std::to_string(index_list[i]) + ".PNG";
-		out_filename = ((i + 1) <= TRAIN_SIZE) ? files[Training] : files[Validation];
-		part_type = (index_list[i] <= 400) ? PartType::BadPart : PartType::GoodPart;
+		if (activation.derivative != exact.derivative)
+			continue;
 
-		std::cout << std::setw(3) << i + 1 << " - Saving Part " << std::setw(3) << index_list[i] << " As A " << (part_type ? "Good Part" : " Bad Part") << " Into " << out_filename << std::endl;
+		double max_error = 0;
+		volatile double sum = 0; // Keeps the timed calls from being optimised away
+		start = std::chrono::steady_clock::now();
+		for (int i = 0; i < n_points; i++)
+		{
+			sum += activation.forward(-20.0 + 40.0 * i / n_points);
+		}
+		const double ns = elapsed_ms(start) * 1e6 / n_points;
+		for (int i = 0; i < n_points; i++)
+		{
+			const double x = -20.0 + 40.0 * i / n_points;
+			max_error = std::max(max_error, fabs(activation.forward(x) - exact.forward(x)));
+		}
 
-		preprocess::process_condensed(in_filename.c_str(), out_filename.c_str(), part_type);
+		score = NeuralNetwork::score_weights(net.m_hidden_weights, net.m_output_weights, inputs, labels, activation);
+		printf("Activation: %-12s %.2f ns per call, max error %.1e, score %1.5f\n", activation.name, ns, max_error, score);
 	}
-#endif
+	return 0;
+}
 
+// Time per sample of a scoring pass, best of a few runs to keep noise out of the comparison
+template <typename F>
+double time_per_sample_us(size_t n_samples, F score)
+{
+	const int passes = 100;
+	double best_ms = 0;
+	for (int run = 0; run < 3; run++)
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (int i = 0; i < passes; i++)
+		{
+			score();
+		}
+		const double ms = elapsed_ms(start);
+		best_ms = run == 0 ? ms : std::min(best_ms, ms);
+	}
+	return best_ms * 1000 / passes / n_samples;
+}
 
-#ifdef TRAINING
-	srand(42);
+int run_prune(const options_t &opts)
+{
+	if (access((opts.network_dir + "/descriptor").c_str(), R_OK) != 0)
+	{
+		printf("No network saved in '%s'\n", opts.network_dir.c_str());
+		return 1;
+	}
+
+	std::vector<Img> imgs = load_set(opts, opts.validation_file);
+	if (imgs.empty())
+		return 1;
 
-	std::vector<Img> imgs = load_csv(files[0]);
-	NeuralNetwork net = NeuralNetwork(64, 200, 2);
-	net.train_model(imgs, 60, 1, 0.15);
-	// net.save("../data/network");
-#endif
+	const Matrix inputs = stack_imgs(imgs);
+	const std::vector<bool> labels = stack_labels(imgs);
+	const Dataset validation_set(imgs);
+	NeuralNetwork net(opts.network_dir);
+	if (validation_set.features() != net.m_input)
+	{
+		printf("The network takes %d inputs but the validation set has %d\n", net.m_input, validation_set.features());
+		return 1;
+	}
 
-#ifdef TUNING
-	mkdir("../data/scores", 0777);
-	FILE *score_matrix = fopen("../data/scores/score_matrix.csv", "w");
-	fprintf(score_matrix, "Score, ");
-	fprintf(score_matrix, "Hidden_nodes, ");
-	fprintf(score_matrix, "Epochs, ");
-	fprintf(score_matrix, "Learning_rate\n");
-	fclose(score_matrix);
+	double score = net.score_batch(inputs, labels);
+	double dense_us = time_per_sample_us(imgs.size(), [&]
+										 { net.score_batch(inputs, labels); });
+	printf("Dense:         score %1.5f, %.3f us per sample\n", score, dense_us);
 
-	srand(42);
+	const uint32_t n_pruned = net.prune(opts.sparsity);
+	const SparseNetwork sparse(net);
+	const size_t dense_bytes = ((size_t)net.m_hidden * net.m_input + (size_t)net.m_output * net.m_hidden) * sizeof(double);
+	printf("Pruned %u of %d hidden weights, %zu of %d inputs still used, %.1f KB of weights against %.1f KB dense\n",
+		   n_pruned, net.m_hidden * net.m_input, sparse.live_inputs(), net.m_input, sparse.footprint() / 1024.0, dense_bytes / 1024.0);
 
-	train_imgs = load_csv(files[0]);
-	test_imgs = load_csv(files[1]);
+	score = net.score_batch(inputs, labels);
+	dense_us = time_per_sample_us(imgs.size(), [&]
+								  { net.score_batch(inputs, labels); });
+	printf("Pruned dense:  score %1.5f, %.3f us per sample\n", score, dense_us);
 
-	populate_hp_combos(0);
-	for (const hyperparameters& hp : possible_hp_combos)
+	std::unique_ptr<deployed_network_t> deployed(new deployed_network_t());
+	if (deployed->load(net))
 	{
-		threads.push_back(std::thread(train_and_save, hp));
+		const double static_us = time_per_sample_us(imgs.size(), [&]
+													 { score = deployed->score(validation_set); });
+		printf("Pruned static: score %1.5f, %.3f us per sample\n", score, static_us);
 	}
 
-	for(std::thread& th : threads)
+	const double sparse_us = time_per_sample_us(imgs.size(), [&]
+												{ score = sparse.score(validation_set); });
+	printf("Sparse:        score %1.5f, %.3f us per sample\n", score, sparse_us);
+
+	if (!opts.pruned_dir.empty() && !net.save(opts.pruned_dir))
+		return 1;
+	return 0;
+}
+
+int run_serve(const options_t &opts)
+{
+	std::unique_ptr<deployed_network_t> deployed_net(new deployed_network_t());
+	if (!deployed_net->load(opts.network_dir))
 	{
-		th.join();
+		printf("No %dx%dx%d network saved in '%s'\n", deployed_network_t::inputs, deployed_network_t::hidden, deployed_network_t::outputs, opts.network_dir.c_str());
+		return 1;
 	}
-	
-#endif
+	if (!opts.shm)
+	{
+		ServerConfig server_config;
+		server_config.socket_path = opts.socket_path;
+		server_config.max_batch = opts.max_batch;
+		server_config.max_delay_us = opts.max_delay_us;
+		server_config.decoders = std::max(1u, opts.threads / 2);
 
-#ifdef TESTING
-	imgs = load_csv(files[1]);
-	double score = net.predict_batch_imgs(imgs);
-	printf("Score: %1.5f\n", score);
-	
-#endif
+		InferenceServer server(*deployed_net, server_config, preprocess::condense_request);
+		if (!server.start())
+			return 1;
 
+		StopSignal stop_signal([&]
+							   { server.stop(); });
+		printf("Serving '%s' on '%s'\n", opts.network_dir.c_str(), opts.socket_path.c_str());
+		server.run();
+		printf("Served %zu requests in %zu batches\n", server.requests(), server.batches());
+		return 0;
+	}
+
+	// Each station gets its own pair of rings and classifier thread, all sharing one network
+	std::vector<std::unique_ptr<ShmRing>> serving_rings;
+	std::vector<std::unique_ptr<ShmClassifier>> classifiers;
+	for (unsigned i = 0; i < opts.stations; i++)
+	{
+		const std::string station = std::to_string(i);
+		serving_rings.emplace_back(new ShmRing("/nn_frames_" + station, true, 16, 4 << 20));
+		serving_rings.emplace_back(new ShmRing("/nn_results_" + station, true, 64, sizeof(InferenceResponse)));
+		if (!serving_rings[2 * i]->is_open() || !serving_rings[2 * i + 1]->is_open())
+			return 1;
+		classifiers.emplace_back(new ShmClassifier(*deployed_net, *serving_rings[2 * i], *serving_rings[2 * i + 1], preprocess::condense_request));
+	}
+
+	StopSignal stop_signal([&]
+						   {
+							   for (std::unique_ptr<ShmRing> &ring : serving_rings)
+							   {
+								   ring->interrupt();
+							   } });
+	printf("Serving '%s' to %u stations on /nn_frames_N and /nn_results_N\n", opts.network_dir.c_str(), opts.stations);
+	std::vector<std::thread> station_threads;
+	for (std::unique_ptr<ShmClassifier> &classifier : classifiers)
+	{
+		station_threads.push_back(std::thread(&ShmClassifier::run, classifier.get()));
+	}
+	for (size_t i = 0; i < station_threads.size(); i++)
+	{
+		station_threads[i].join();
+		printf("Station %zu: %zu frames\n", i, classifiers[i]->frames());
+	}
 	return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char *argv[])
+{
+	struct command_t
+	{
+		const char *name;
+		int (*run)(const options_t &);
+	};
+	const command_t commands[] = {
+		{"preprocess", run_preprocess},
+		{"train", run_train},
+		{"tune", run_tune},
+		{"eval", run_eval},
+		{"prune", run_prune},
+		{"bench", run_bench},
+		{"serve", run_serve}};
+
+	if (argc < 2 || !strcmp(argv[1], "--help") || !strcmp(argv[1], "-h"))
+	{
+		printf("%s", usage);
+		return argc < 2;
+	}
+
+	for (const command_t &command : commands)
+	{
+		if (strcmp(argv[1], command.name) != 0)
+			continue;
+
+		options_t opts;
+		if (!parse_options(argc - 1, argv + 1, opts))
+		{
+			printf("Run 'NN --help' for the list of options\n");
+			return 1;
+		}
+		ThreadPool::set_shared_threads(opts.threads);
+		return command.run(opts);
+	}
+
+	printf("Unknown command '%s'\n\n%s", argv[1], usage);
+	return 1;
+}
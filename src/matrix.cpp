@@ -1,4 +1,5 @@
 #include "matrix.h"
+#include "thread_pool.h"
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,12 +8,60 @@
 #include <iostream>
 
 #define MAXCHAR 100
+#define DOT_TILE_COLS 64
 
 Matrix::Matrix(const uint16_t _rows, const uint16_t _columns)
-	: m_entries(_rows, std::vector<double>(_columns)) {}
+	: m_entries(_rows, row_t(_columns)) {}
 
 Matrix::Matrix(const Matrix &mat) : m_entries(mat.m_entries) {}
 
+Matrix::Matrix(Matrix &&mat) noexcept : m_entries(std::move(mat.m_entries)) {}
+
+Matrix &Matrix::operator=(const Matrix &mat)
+{
+	if (this == &mat)
+		return *this;
+
+	resize(mat.rows(), mat.cols());
+	for (int i = 0; i < rows(); i++)
+	{
+		std::copy(mat.m_entries[i].begin(), mat.m_entries[i].end(), m_entries[i].begin());
+	}
+	return *this;
+}
+
+Matrix &Matrix::operator=(Matrix &&mat)
+{
+	// Allocators never propagate, so buffers from a different arena are copied rather than stolen
+	if (m_entries.get_allocator() == mat.m_entries.get_allocator())
+		m_entries.swap(mat.m_entries);
+	else
+		*this = static_cast<const Matrix &>(mat);
+	return *this;
+}
+
+void Matrix::swap(Matrix &mat)
+{
+	if (m_entries.get_allocator() == mat.m_entries.get_allocator())
+	{
+		m_entries.swap(mat.m_entries);
+		return;
+	}
+
+	Matrix temp = *this;
+	*this = mat;
+	mat = temp;
+}
+
+void Matrix::resize(const uint16_t _rows, const uint16_t _columns)
+{
+	m_entries.resize(_rows);
+	for (row_t &row : m_entries)
+	{
+		row.resize(_columns);
+	}
+}
+
 Matrix::Matrix(std::string file_string)
 {
 	FILE *file = fopen(file_string.c_str(), "r");
@@ -23,7 +72,7 @@ Matrix::Matrix(std::string file_string)
 	fgets(entry, MAXCHAR, file);
 	int col_size = atoi(entry);
 
-	*this = Matrix(row_size, col_size);
+	resize(row_size, col_size);
 
 	for (int i = 0; i < rows(); i++) // Use an iterator instead
 	{
@@ -53,9 +102,14 @@ void Matrix::print() const
 	}
 }
 
-void Matrix::save(std::string file_string)
+bool Matrix::save(std::string file_string)
 {
 	FILE *file = fopen(file_string.c_str(), "w");
+	if (!file)
+	{
+		printf("Could not write matrix to %s\n", file_string.c_str());
+		return false;
+	}
 
 	fprintf(file, "%d\n", rows());
 	fprintf(file, "%d\n", cols());
@@ -69,19 +123,19 @@ void Matrix::save(std::string file_string)
 	}
 
 	printf("Successfully saved matrix to %s\n", file_string.c_str());
-	fclose(file);
+	return fclose(file) == 0;
 }
 
-void Matrix::randomize(uint16_t n)
+void Matrix::randomize(uint16_t n, Rng &rng)
 {
 	const double min = -1.0 / sqrt(n);
-	const int scaled_difference = (min - 1.0 / sqrt(n)) * 10000;
+	const double max = 1.0 / sqrt(n);
 
 	for (int i = 0; i < rows(); i++)
 	{
 		for (int j = 0; j < cols(); j++)
 		{
-			m_entries[i][j] = min + (1.0 * (rand() % scaled_difference) / 10000);
+			m_entries[i][j] = rng.uniform(min, max);
 		}
 	}
 }
@@ -109,7 +163,7 @@ void Matrix::flatten(bool axis)
 	const uint32_t rows_size = (((rows() * cols()) - 1) * axis) + 1;
 	const uint32_t cols_size = (((rows() * cols()) - 1) * !axis) + 1;
 
-	matrix_t temp_mat(rows_size, std::vector<double>(cols_size));
+	Matrix temp_mat(rows_size, cols_size);
 
 	for (int i = 0; i < rows(); i++)
 	{
@@ -117,11 +171,11 @@ void Matrix::flatten(bool axis)
 		for (int j = 0; j < cols(); j++)
 		{
 			const uint32_t absolute_index = col_index + j;
-			temp_mat[absolute_index * axis][absolute_index * !axis] = m_entries[i][j];
+			temp_mat.m_entries[absolute_index * axis][absolute_index * !axis] = m_entries[i][j];
 		}
 	}
 
-	m_entries = temp_mat;
+	*this = std::move(temp_mat);
 }
 
 void Matrix::multiply(const Matrix &mat)
@@ -129,13 +183,15 @@ void Matrix::multiply(const Matrix &mat)
 	if (!check_dimensions(mat))
 		exit(1);
 
-	for (int i = 0; i < rows(); i++)
-	{
-		for (int j = 0; j < cols(); j++)
-		{
-			m_entries[i][j] *= mat.m_entries[i][j];
-		}
-	}
+	parallel_rows(rows(), cols(), [&](size_t begin, size_t end)
+				  {
+					  for (size_t i = begin; i < end; i++)
+					  {
+						  for (int j = 0; j < cols(); j++)
+						  {
+							  m_entries[i][j] *= mat.m_entries[i][j];
+						  }
+					  } });
 }
 
 void Matrix::add(const Matrix &mat)
@@ -143,13 +199,15 @@ void Matrix::add(const Matrix &mat)
 	if (!check_dimensions(mat))
 		exit(1);
 
-	for (int i = 0; i < rows(); i++)
-	{
-		for (int j = 0; j < cols(); j++)
-		{
-			m_entries[i][j] += mat.m_entries[i][j];
-		}
-	}
+	parallel_rows(rows(), cols(), [&](size_t begin, size_t end)
+				  {
+					  for (size_t i = begin; i < end; i++)
+					  {
+						  for (int j = 0; j < cols(); j++)
+						  {
+							  m_entries[i][j] += mat.m_entries[i][j];
+						  }
+					  } });
 }
 
 void Matrix::subtract(const Matrix &mat)
@@ -157,79 +215,103 @@ void Matrix::subtract(const Matrix &mat)
 	if (!check_dimensions(mat))
 		exit(1);
 
-	for (int i = 0; i < rows(); i++)
-	{
-		for (int j = 0; j < cols(); j++)
-		{
-			m_entries[i][j] -= mat.m_entries[i][j];
-		}
-	}
+	parallel_rows(rows(), cols(), [&](size_t begin, size_t end)
+				  {
+					  for (size_t i = begin; i < end; i++)
+					  {
+						  for (int j = 0; j < cols(); j++)
+						  {
+							  m_entries[i][j] -= mat.m_entries[i][j];
+						  }
+					  } });
 }
 
 void Matrix::apply(function_t func)
 {
-	for (int i = 0; i < rows(); i++)
-	{
-		for (int j = 0; j < cols(); j++)
-		{
-			m_entries[i][j] = func(m_entries[i][j]);
-		}
-	}
+	// func is called from several threads at once on a large matrix
+	parallel_rows(rows(), cols(), [&](size_t begin, size_t end)
+				  {
+					  for (size_t i = begin; i < end; i++)
+					  {
+						  for (int j = 0; j < cols(); j++)
+						  {
+							  m_entries[i][j] = func(m_entries[i][j]);
+						  }
+					  } });
 }
 
 void Matrix::dot(const Matrix &mat)
 {
-	if (cols() != mat.rows())
+	Matrix temp_mat;
+	dot_into(mat, temp_mat);
+	*this = std::move(temp_mat);
+}
+
+void Matrix::dot_into(const Matrix &mat, Matrix &out) const
+{
+	if (cols() != mat.rows() || &out == this || &out == &mat)
 		exit(1);
 
-	matrix_t temp_mat(rows(), std::vector<double>(mat.cols()));
-	for (int i = 0; i < rows(); i++)
-	{
-		for (int j = 0; j < mat.cols(); j++)
-		{
-			for (int k = 0; k < mat.rows(); k++)
-			{
-				temp_mat[i][j] += m_entries[i][k] * mat.m_entries[k][j];
-			}
-		}
-	}
-	m_entries = temp_mat;
+	out.resize(rows(), mat.cols());
+
+	// Tiles of one output row by up to DOT_TILE_COLS columns. Every entry is summed in the
+	// same order whichever thread gets its tile, so the result doesn't depend on the split
+	const size_t tile_cols = std::min<size_t>(DOT_TILE_COLS, mat.cols());
+	const size_t col_tiles = (mat.cols() + DOT_TILE_COLS - 1) / DOT_TILE_COLS;
+	parallel_rows((size_t)rows() * col_tiles, tile_cols * mat.rows(), [&](size_t begin, size_t end)
+				  {
+					  for (size_t tile = begin; tile < end; tile++)
+					  {
+						  const size_t i = tile / col_tiles;
+						  const size_t first = tile % col_tiles * DOT_TILE_COLS;
+						  const size_t last = std::min<size_t>(first + DOT_TILE_COLS, mat.cols());
+						  for (size_t j = first; j < last; j++)
+						  {
+							  double total = 0;
+							  for (int k = 0; k < mat.rows(); k++)
+							  {
+								  total += m_entries[i][k] * mat.m_entries[k][j];
+							  }
+							  out.m_entries[i][j] = total;
+						  }
+					  } });
 }
 
 void Matrix::scale(const double n)
 {
-	for (int i = 0; i < rows(); i++)
-	{
-		for (int j = 0; j < cols(); j++)
-		{
-			m_entries[i][j] *= n;
-		}
-	}
+	parallel_rows(rows(), cols(), [&](size_t begin, size_t end)
+				  {
+					  for (size_t i = begin; i < end; i++)
+					  {
+						  for (int j = 0; j < cols(); j++)
+						  {
+							  m_entries[i][j] *= n;
+						  }
+					  } });
 }
 
 void Matrix::transpose()
 {
-	matrix_t temp_mat(cols(), std::vector<double>(rows()));
-
-	for (int i = 0; i < rows(); i++)
-	{
-		for (int j = 0; j < cols(); j++)
-		{
-			temp_mat[j][i] = m_entries[i][j];
-		}
-	}
-
-	m_entries = temp_mat;
+	Matrix temp_mat;
+	transpose_into(temp_mat);
+	*this = std::move(temp_mat);
 }
 
-double sigmoid(double input)
+void Matrix::transpose_into(Matrix &out) const
 {
-	return 1.0 / (1.0 + exp(-input));
-}
+	if (&out == this)
+		exit(1);
 
-double sigmoid_prime(double input)
-{
-	return exp(input) / pow(exp(input) + 1, 2.0);
+	out.resize(cols(), rows());
+	parallel_rows(rows(), cols(), [&](size_t begin, size_t end)
+				  {
+					  for (size_t i = begin; i < end; i++)
+					  {
+						  for (int j = 0; j < cols(); j++)
+						  {
+							  out.m_entries[j][i] = m_entries[i][j];
+						  }
+					  } });
 }
 
 Matrix Matrix::soft_max()
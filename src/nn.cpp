@@ -1,29 +1,34 @@
 #include "nn.h"
+#include "thread_pool.h"
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <iostream>
 #include <string.h>
+#include <numeric>
+#include <algorithm>
+#include <math.h>
+#include <thread>
 
 #define MAXCHAR 1000
 
-NeuralNetwork::NeuralNetwork(int input, int hidden, int output) : m_input(input), m_hidden(hidden), m_output(output)
+NeuralNetwork::NeuralNetwork(int input, int hidden, int output, uint64_t seed, uint64_t id) : m_input(input), m_hidden(hidden), m_output(output)
 {
 	Matrix hidden_layer(m_hidden, m_input);
 	Matrix output_layer(m_output, m_hidden);
+	Rng rng = Rng::stream(seed, id, WeightInit);
 
-	hidden_layer.randomize(m_hidden);
-	output_layer.randomize(m_output);
+	hidden_layer.randomize(m_hidden, rng);
+	output_layer.randomize(m_output, rng);
 
-	m_hidden_weights = hidden_layer;
-	m_output_weights = output_layer;
+	m_hidden_weights = std::move(hidden_layer);
+	m_output_weights = std::move(output_layer);
 }
 
 NeuralNetwork::NeuralNetwork(std::string file_string)
 {
 	char entry[MAXCHAR];
-	chdir(file_string.c_str());
-	FILE *descriptor = fopen("descriptor", "r");
+	FILE *descriptor = fopen((file_string + "/descriptor").c_str(), "r");
 
 	fgets(entry, MAXCHAR, descriptor);
 	m_input = atoi(entry);
@@ -31,139 +36,338 @@ NeuralNetwork::NeuralNetwork(std::string file_string)
 	m_hidden = atoi(entry);
 	fgets(entry, MAXCHAR, descriptor);
 	m_output = atoi(entry);
+	// Checkpoints from before activations were configurable have no fourth line and use sigmoid
+	if (fgets(entry, MAXCHAR, descriptor))
+	{
+		entry[strcspn(entry, "\r\n")] = 0;
+		const Activation *activation = find_activation(entry);
+		if (activation)
+			m_activation = activation;
+		else
+			printf("Unknown activation '%s', using %s\n", entry, m_activation->name);
+	}
 
 	fclose(descriptor);
 
-	m_hidden_weights = Matrix("hidden");
-	m_output_weights = Matrix("output");
+	m_hidden_weights = Matrix(file_string + "/hidden");
+	m_output_weights = Matrix(file_string + "/output");
 
 	printf("Successfully loaded network from '%s'\n", file_string.c_str());
-	chdir("-"); // Go back to the original directory
 }
 
-void NeuralNetwork::train(Matrix _input, Matrix _output)
+// Input is read straight from the shared dataset, so no per-sample copy or flatten is needed
+void NeuralNetwork::train(const double *input, const bool label)
 {
-	Matrix input_calculations = m_hidden_weights;
-	Matrix output_calculations = m_output_weights;
-	Matrix hidden_errors = m_output_weights;
+	// Every temporary of a step comes from this arena and is handed back in one go when the
+	// step ends, so once the first step has sized the arena training stops touching malloc
+	static thread_local Arena scratch;
+	ArenaScope scope(scratch);
+
+	Matrix input_calculations(m_hidden, 1);
+	Matrix output_calculations;
+	Matrix hidden_errors;
+	Matrix errors(m_output, 1);
+	Matrix transposed;
+	Matrix deltas;
 
-	// Feed Forward
-	input_calculations.dot(_input);
-	input_calculations.apply(sigmoid);
-	output_calculations.dot(input_calculations);
-	output_calculations.apply(sigmoid);
+	// Feed Forward, split over hidden nodes when the layer is big enough to be worth it
+	parallel_rows(m_hidden, m_input, [&](size_t begin, size_t end)
+				  {
+					  for (size_t i = begin; i < end; i++)
+					  {
+						  const Matrix::row_t &weights = m_hidden_weights.m_entries[i];
+						  double total = 0;
+						  for (int k = 0; k < m_input; k++)
+						  {
+							  total += weights[k] * input[k];
+						  }
+						  input_calculations.m_entries[i][0] = total;
+					  } });
+	input_calculations.apply(m_activation->forward);
+	m_output_weights.dot_into(input_calculations, output_calculations);
+	output_calculations.apply(m_activation->forward);
 
 	// Find Errors
-	_output.subtract(output_calculations);
-	hidden_errors.transpose();
-	hidden_errors.dot(_output);
+	errors.m_entries[label][0] = 1;
+	errors.subtract(output_calculations);
+	m_output_weights.transpose_into(transposed);
+	transposed.dot_into(errors, hidden_errors);
 
 	// Feed Backward
-	// Output Weights
-	output_calculations.apply(sigmoid_prime);
-	_output.multiply(output_calculations);
-	input_calculations.transpose();
-	_output.dot(input_calculations);
-	_output.scale(m_learning_rate /  m_batch_size);
-	m_output_weights.add(_output);
+	// Output Weights, derivatives come straight from the cached activations
+	output_calculations.apply(m_activation->derivative);
+	errors.multiply(output_calculations);
+	input_calculations.transpose_into(transposed);
+	errors.dot_into(transposed, deltas);
+	deltas.scale(m_learning_rate / m_batch_size);
+	m_output_weights.add(deltas);
 
 	// Hidden Weights
-	input_calculations.transpose();
-	input_calculations.apply(sigmoid_prime);
+	input_calculations.apply(m_activation->derivative);
 	input_calculations.multiply(hidden_errors);
-	_input.transpose();
-	input_calculations.dot(_input);
-	input_calculations.scale(m_learning_rate /  m_batch_size);
-	m_hidden_weights.add(input_calculations);
+	const double rate = m_learning_rate / m_batch_size;
+	parallel_rows(m_hidden, m_input, [&](size_t begin, size_t end)
+				  {
+					  for (size_t i = begin; i < end; i++)
+					  {
+						  Matrix::row_t &weights = m_hidden_weights.m_entries[i];
+						  const double delta = input_calculations.m_entries[i][0];
+						  for (int k = 0; k < m_input; k++)
+						  {
+							  weights[k] += delta * input[k] * rate;
+						  }
+					  } });
 }
 
-void NeuralNetwork::train_batch_imgs(const std::vector<Img> &imgs)
+void NeuralNetwork::train_dataset(const Dataset &dataset)
 {
-	double real_learning_rate = m_learning_rate;
-	for (int i = 0; i < imgs.size(); i++)
+	for (size_t i = 0; i < dataset.size(); i++)
 	{
-		Img cur_img = imgs[i];
-		cur_img.img_data.flatten(true); // false = flatten to single row vector
-		Matrix output(2, 1);
-		output.m_entries[cur_img.label][0] = 1;
-		train(cur_img.img_data, output);
+		train(dataset.sample(i), dataset.label(i));
 	}
 }
 
-void NeuralNetwork::train_model(const std::vector<Img> &imgs, uint16_t epochs, uint16_t batch_size, double learning_rate)
+void NeuralNetwork::train_dataset(const Dataset &dataset, const std::vector<uint32_t> &order)
 {
-	m_learning_rate = learning_rate;
-	m_batch_size = batch_size;
-	train_batch_imgs(imgs);
-	return;
-		
-	std::vector<std::vector<Img>> bunches;
-	if (batch_size == 0)
+	for (uint32_t i : order)
+	{
+		train(dataset.sample(i), dataset.label(i));
+	}
+}
+
+// Loader threads copy the samples of each epoch, in training order, into mini-batches on a
+// BatchQueue while this thread trains on them. Samples are visited in exactly the order
+// train_dataset would visit them, so the resulting weights are the same
+void NeuralNetwork::train_pipelined(const Dataset &dataset, uint16_t epochs, Rng *shuffle_rng)
+{
+	const uint32_t n_samples = dataset.size();
+	const uint32_t batch_samples = std::max<uint32_t>(min_pipeline_batch, m_batch_size);
+	const size_t batches_per_epoch = (n_samples + batch_samples - 1) / batch_samples;
+	const size_t n_batches = batches_per_epoch * epochs;
+	if (n_batches == 0)
+		return;
+
+	// Every epoch's order is drawn up front so loaders can run ahead into the next epoch
+	std::vector<std::vector<uint32_t>> orders;
+	if (shuffle_rng)
+	{
+		std::vector<uint32_t> order(n_samples);
+		std::iota(order.begin(), order.end(), 0);
+		for (uint16_t epoch = 0; epoch < epochs; epoch++)
+		{
+			shuffle_rng->shuffle(order);
+			orders.push_back(order);
+		}
+	}
+
+	BatchQueue queue(2 * m_loaders + 2);
+
+	auto loader = [&]
 	{
-		m_batch_size = imgs.size();
-		bunches.push_back(imgs);
+		size_t ticket;
+		MiniBatch *batch;
+		while (queue.begin_push(n_batches, ticket, batch))
+		{
+			const size_t epoch = ticket / batches_per_epoch;
+			const uint32_t first = (ticket % batches_per_epoch) * batch_samples;
+			const uint16_t features = dataset.features();
+
+			batch->size = std::min(batch_samples, n_samples - first);
+			batch->features = features;
+			batch->inputs.resize((size_t)batch->size * features);
+			batch->labels.resize(batch->size);
+
+			for (uint32_t j = 0; j < batch->size; j++)
+			{
+				const uint32_t i = orders.empty() ? first + j : orders[epoch][first + j];
+				std::copy(dataset.sample(i), dataset.sample(i) + features, &batch->inputs[(size_t)j * features]);
+				batch->labels[j] = dataset.label(i);
+			}
+			queue.end_push(ticket);
+		}
+	};
+
+	// Loaders keep their cores busy, so matrix operations on this thread don't get them as helpers
+	CoreReservation cores(ThreadPool::shared(), m_loaders);
+	std::vector<std::thread> loaders;
+	for (unsigned i = 0; i < m_loaders; i++)
+	{
+		loaders.push_back(std::thread(loader));
 	}
-	else
+
+	for (size_t n = 0; n < n_batches; n++)
 	{
-		for (size_t i = 0; i < imgs.size(); i += batch_size)
+		size_t ticket;
+		const MiniBatch &batch = queue.begin_pop(ticket);
+		for (uint32_t j = 0; j < batch.size; j++)
 		{
-			auto last = std::min(imgs.size(), i + batch_size);
-			bunches.emplace_back(imgs.begin() + i, imgs.begin() + last);
+			train(batch.sample(j), batch.labels[j]);
 		}
+		queue.end_pop(ticket);
+	}
+
+	for (std::thread &th : loaders)
+	{
+		th.join();
+	}
+}
+
+void NeuralNetwork::train_model(const Dataset &dataset, uint16_t epochs, uint16_t batch_size, double learning_rate, Rng *shuffle_rng)
+{
+	m_learning_rate = learning_rate;
+	m_batch_size = batch_size == 0 ? dataset.size() : batch_size;
+
+	if (m_loaders > 0)
+	{
+		train_pipelined(dataset, epochs, shuffle_rng);
+		return;
+	}
+
+	std::vector<uint32_t> order;
+	if (shuffle_rng)
+	{
+		order.resize(dataset.size());
+		std::iota(order.begin(), order.end(), 0);
 	}
 
 	for (size_t epoch = 0; epoch < epochs; epoch++)
 	{
-		for (auto it = bunches.begin(); it != bunches.end(); ++it)
+		if (!shuffle_rng)
 		{
-			train_batch_imgs(*it);
+			train_dataset(dataset);
+			continue;
 		}
+
+		shuffle_rng->shuffle(order);
+		train_dataset(dataset, order);
 	}
-	
 }
 
 double NeuralNetwork::predict_batch_imgs(const std::vector<Img> &imgs)
 {
 	int n_correct = 0;
+	Matrix input_data;
 	for (int i = 0; i < imgs.size(); i++)
 	{
-		Img cur_img = imgs[i];
-		cur_img.img_data.flatten(true);
-		Matrix prediction = predict(cur_img.img_data);
+		input_data = imgs[i].img_data;
+		input_data.flatten(true);
+		Matrix prediction = predict(input_data);
 
 		std::cout << "0 - " << prediction.m_entries[0][0] << " | 1 - " << prediction.m_entries[1][0]
-				  << " | argmax - " << prediction.max_value() << " | result - " << cur_img.label << std::endl;
-		n_correct += prediction.max_value() == cur_img.label;
+				  << " | argmax - " << prediction.max_value() << " | result - " << imgs[i].label << std::endl;
+		n_correct += prediction.max_value() == imgs[i].label;
 	}
 	return 1.0 * n_correct / imgs.size();
 }
 
+// Silent counterpart to predict_batch_imgs, inputs holds one sample per column
+double NeuralNetwork::score_batch(const Matrix &inputs, const std::vector<bool> &labels)
+{
+	return score_weights(m_hidden_weights, m_output_weights, inputs, labels, *m_activation);
+}
+
+double NeuralNetwork::score_weights(const Matrix &hidden_weights, const Matrix &output_weights, const Matrix &inputs, const std::vector<bool> &labels,
+									const Activation &activation)
+{
+	Matrix input_calculations;
+	Matrix output_calculations;
+
+	hidden_weights.dot_into(inputs, input_calculations);
+	input_calculations.apply(activation.forward);
+	output_weights.dot_into(input_calculations, output_calculations);
+	output_calculations.apply(activation.forward);
+
+	int n_correct = 0;
+	for (int n = 0; n < output_calculations.cols(); n++)
+	{
+		uint32_t max_idx = 0;
+		for (int i = 1; i < output_calculations.rows(); i++)
+		{
+			if (output_calculations.m_entries[i][n] > output_calculations.m_entries[max_idx][n])
+				max_idx = i;
+		}
+		n_correct += max_idx == labels[n];
+	}
+	return 1.0 * n_correct / labels.size();
+}
+
 Matrix NeuralNetwork::predict(const Matrix &input_data)
 {
-	Matrix input_calculations = m_hidden_weights;
-	Matrix output_calculations = m_output_weights;
+	Matrix input_calculations;
+	Matrix output_calculations;
 
-	input_calculations.dot(input_data);
-	input_calculations.apply(sigmoid);
-	output_calculations.dot(input_calculations);
-	output_calculations.apply(sigmoid);
+	m_hidden_weights.dot_into(input_data, input_calculations);
+	input_calculations.apply(m_activation->forward);
+	m_output_weights.dot_into(input_calculations, output_calculations);
+	output_calculations.apply(m_activation->forward);
 	output_calculations.soft_max();
 	return output_calculations;
 }
 
-void NeuralNetwork::save(std::string file_string)
+uint32_t NeuralNetwork::prune(double sparsity)
+{
+	const size_t n_weights = (size_t)m_hidden * m_input;
+	const size_t n_pruned = std::min<size_t>(n_weights, std::max(0.0, sparsity) * n_weights);
+	if (n_pruned == 0)
+		return 0;
+
+	std::vector<double> magnitudes;
+	magnitudes.reserve(n_weights);
+	for (int i = 0; i < m_hidden; i++)
+	{
+		for (int k = 0; k < m_input; k++)
+		{
+			magnitudes.push_back(fabs(m_hidden_weights.m_entries[i][k]));
+		}
+	}
+	std::nth_element(magnitudes.begin(), magnitudes.begin() + n_pruned - 1, magnitudes.end());
+	const double cut_off = magnitudes[n_pruned - 1];
+
+	// Everything under the cut off goes first, then weights equal to it until the count is met
+	size_t below = 0;
+	for (double magnitude : magnitudes)
+	{
+		below += magnitude < cut_off;
+	}
+	size_t ties = n_pruned - below;
+	for (int i = 0; i < m_hidden; i++)
+	{
+		for (int k = 0; k < m_input; k++)
+		{
+			double &weight = m_hidden_weights.m_entries[i][k];
+			const double magnitude = fabs(weight);
+			if (magnitude < cut_off)
+			{
+				weight = 0;
+			}
+			else if (magnitude == cut_off && ties > 0)
+			{
+				weight = 0;
+				ties--;
+			}
+		}
+	}
+	return n_pruned;
+}
+
+bool NeuralNetwork::save(std::string file_string)
 {
 	mkdir(file_string.c_str(), 0777);
-	chdir(file_string.c_str());
-	FILE *descriptor = fopen("descriptor", "w");
+	FILE *descriptor = fopen((file_string + "/descriptor").c_str(), "w");
+	if (!descriptor)
+	{
+		printf("Could not write network to '%s'\n", file_string.c_str());
+		return false;
+	}
 	fprintf(descriptor, "%d\n", m_input);
 	fprintf(descriptor, "%d\n", m_hidden);
 	fprintf(descriptor, "%d\n", m_output);
+	fprintf(descriptor, "%s\n", m_activation->name);
 	fclose(descriptor);
-	m_hidden_weights.save("hidden");
-	m_output_weights.save("output");
+	if (!m_hidden_weights.save(file_string + "/hidden") || !m_output_weights.save(file_string + "/output"))
+		return false;
 	printf("Successfully written to '%s'\n", file_string.c_str());
-	chdir("-");
+	return true;
 }
 
 void NeuralNetwork::print() const
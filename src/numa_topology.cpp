@@ -0,0 +1,157 @@
+#include "numa_topology.h"
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#ifdef HAVE_LIBNUMA
+#include <numa.h>
+#endif
+
+#define CACHE_LINE 64
+
+// "0-3,8-11" style lists as used by sysfs
+static std::vector<int> parse_cpu_list(const char *list)
+{
+	std::vector<int> cpus;
+	while (*list)
+	{
+		char *end;
+		const long first = strtol(list, &end, 10);
+		if (end == list)
+			break;
+		long last = first;
+		if (*end == '-')
+			last = strtol(end + 1, &end, 10);
+		for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+		{
+			cpus.push_back(cpu);
+		}
+		list = *end == ',' ? end + 1 : end;
+		if (*list == '\n')
+			break;
+	}
+	return cpus;
+}
+
+const NumaTopology &NumaTopology::get()
+{
+	static NumaTopology topology;
+	return topology;
+}
+
+NumaTopology::NumaTopology()
+{
+#ifdef HAVE_LIBNUMA
+	if (numa_available() >= 0)
+	{
+		m_libnuma = true;
+		struct bitmask *cpus = numa_allocate_cpumask();
+		for (int node = 0; node <= numa_max_node(); node++)
+		{
+			if (numa_node_to_cpus(node, cpus) != 0)
+				continue;
+
+			std::vector<int> node_cpus;
+			for (unsigned cpu = 0; cpu < cpus->size && cpu < CPU_SETSIZE; cpu++)
+			{
+				if (numa_bitmask_isbitset(cpus, cpu))
+					node_cpus.push_back(cpu);
+			}
+			if (!node_cpus.empty())
+			{
+				m_node_ids.push_back(node);
+				m_node_cpus.push_back(node_cpus);
+			}
+		}
+		numa_free_cpumask(cpus);
+		return;
+	}
+#endif
+
+	DIR *dir = opendir("/sys/devices/system/node");
+	if (!dir)
+		return;
+
+	std::vector<int> node_ids;
+	while (dirent *entry = readdir(dir))
+	{
+		if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9')
+			node_ids.push_back(atoi(entry->d_name + 4));
+	}
+	closedir(dir);
+	std::sort(node_ids.begin(), node_ids.end());
+
+	for (int node : node_ids)
+	{
+		const std::string file_string = "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+		FILE *file = fopen(file_string.c_str(), "r");
+		if (!file)
+			continue;
+
+		char list[4096] = {};
+		std::vector<int> node_cpus;
+		if (fgets(list, sizeof(list), file))
+			node_cpus = parse_cpu_list(list);
+		fclose(file);
+
+		// Memory only nodes have nothing to run workers on
+		if (!node_cpus.empty())
+		{
+			m_node_ids.push_back(node);
+			m_node_cpus.push_back(node_cpus);
+		}
+	}
+}
+
+bool NumaTopology::pin_to_node(int node) const
+{
+	if (!multi_node() || node < 0 || (size_t)node >= nodes())
+		return false;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu : m_node_cpus[node])
+	{
+		CPU_SET(cpu, &set);
+	}
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+		return false;
+
+#ifdef HAVE_LIBNUMA
+	if (m_libnuma)
+		numa_set_preferred(m_node_ids[node]);
+#endif
+	return true;
+}
+
+void *NumaTopology::alloc_on_node(size_t size, int node) const
+{
+#ifdef HAVE_LIBNUMA
+	if (m_libnuma && node >= 0 && multi_node())
+		return numa_alloc_onnode(size, m_node_ids[node]);
+#endif
+
+	void *buffer = nullptr;
+	if (posix_memalign(&buffer, CACHE_LINE, size) != 0)
+		return nullptr;
+	return buffer;
+}
+
+void NumaTopology::free_on_node(void *ptr, size_t size, int node) const
+{
+	if (!ptr)
+		return;
+
+#ifdef HAVE_LIBNUMA
+	if (m_libnuma && node >= 0 && multi_node())
+	{
+		numa_free(ptr, size);
+		return;
+	}
+#endif
+	free(ptr);
+}
@@ -0,0 +1,186 @@
+#include "results_sink.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <chrono>
+
+ResultsSink::ResultsSink(const std::string &file_string, SinkFormat format, FsyncPolicy fsync_policy, size_t capacity, size_t batch_size)
+	: m_format(format), m_fsync_policy(fsync_policy), m_batch_size(batch_size), m_enqueue_pos(0), m_dequeue_pos(0), m_running(true)
+{
+	size_t rounded_capacity = 2;
+	while (rounded_capacity < capacity)
+		rounded_capacity <<= 1;
+
+	m_mask = rounded_capacity - 1;
+	m_slots.reset(new Slot[rounded_capacity]);
+	for (size_t i = 0; i < rounded_capacity; i++)
+	{
+		m_slots[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	m_fd = open(file_string.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (m_fd < 0)
+	{
+		printf("Failed to open results file '%s'\n", file_string.c_str());
+		m_running = false;
+		return;
+	}
+
+	if (m_format == SinkFormat::Csv)
+	{
+		m_buffer = "Score, Hidden_nodes, Epochs, Learning_rate, Batch_size, Trial\n";
+	}
+	else if (m_format == SinkFormat::Binary)
+	{
+		const uint32_t version = 1;
+		m_buffer.append("NNSC", 4);
+		m_buffer.append((const char *)&version, sizeof(version));
+	}
+	flush_buffer();
+
+	m_writer = std::thread(&ResultsSink::writer_loop, this);
+}
+
+ResultsSink::~ResultsSink()
+{
+	close();
+}
+
+void ResultsSink::push(const TrialResult &result)
+{
+	if (m_fd < 0)
+		return;
+
+	size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		Slot &slot = m_slots[pos & m_mask];
+		const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+		const intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+
+		if (diff == 0)
+		{
+			if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				slot.result = result;
+				slot.sequence.store(pos + 1, std::memory_order_release);
+				return;
+			}
+		}
+		else if (diff < 0)
+		{
+			// Ring is full, wait for the writer to catch up
+			std::this_thread::yield();
+			pos = m_enqueue_pos.load(std::memory_order_relaxed);
+		}
+		else
+		{
+			pos = m_enqueue_pos.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+bool ResultsSink::pop(TrialResult &result)
+{
+	Slot &slot = m_slots[m_dequeue_pos & m_mask];
+	const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+
+	if (sequence != m_dequeue_pos + 1)
+		return false;
+
+	result = slot.result;
+	slot.sequence.store(m_dequeue_pos + m_mask + 1, std::memory_order_release);
+	m_dequeue_pos++;
+	return true;
+}
+
+void ResultsSink::format(const TrialResult &result)
+{
+	char line[256];
+	int length = 0;
+
+	switch (m_format)
+	{
+	case SinkFormat::Csv:
+		length = snprintf(line, sizeof(line), "%1.5f, %d, %d, %1.5f, %d, %u\n", result.score, result.params.hidden_nodes,
+						  result.params.epochs, result.params.learning_rate, result.params.batch_size, result.id);
+		break;
+	case SinkFormat::JsonLines:
+		length = snprintf(line, sizeof(line), "{\"trial\":%u,\"score\":%.5f,\"hidden_nodes\":%d,\"epochs\":%d,\"learning_rate\":%.5f,\"batch_size\":%d}\n",
+						  result.id, result.score, result.params.hidden_nodes, result.params.epochs, result.params.learning_rate, result.params.batch_size);
+		break;
+	case SinkFormat::Binary:
+	{
+		BinaryScoreRecord record = {result.id, result.score, result.params.learning_rate,
+									result.params.hidden_nodes, result.params.epochs, result.params.batch_size};
+		m_buffer.append((const char *)&record, sizeof(record));
+		return;
+	}
+	}
+
+	m_buffer.append(line, length);
+}
+
+void ResultsSink::flush_buffer()
+{
+	size_t written = 0;
+	while (written < m_buffer.size())
+	{
+		const ssize_t n = write(m_fd, m_buffer.data() + written, m_buffer.size() - written);
+		if (n <= 0)
+			break;
+		written += n;
+	}
+	m_buffer.clear();
+}
+
+void ResultsSink::writer_loop()
+{
+	TrialResult result;
+	for (;;)
+	{
+		// Read the flag before draining so nothing pushed ahead of close() is left behind
+		const bool running = m_running.load(std::memory_order_acquire);
+
+		size_t n_batched = 0;
+		while (pop(result))
+		{
+			format(result);
+			if (++n_batched == m_batch_size)
+			{
+				flush_buffer();
+				if (m_fsync_policy == FsyncPolicy::EveryBatch)
+					fsync(m_fd);
+				n_batched = 0;
+			}
+		}
+
+		if (n_batched)
+		{
+			flush_buffer();
+			if (m_fsync_policy == FsyncPolicy::EveryBatch)
+				fsync(m_fd);
+		}
+
+		if (!running)
+			return;
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(2));
+	}
+}
+
+void ResultsSink::close()
+{
+	if (m_fd < 0)
+		return;
+
+	m_running.store(false, std::memory_order_release);
+	if (m_writer.joinable())
+		m_writer.join();
+
+	if (m_fsync_policy != FsyncPolicy::Never)
+		fsync(m_fd);
+
+	::close(m_fd);
+	m_fd = -1;
+}
@@ -0,0 +1,203 @@
+#include "shm_ring.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <new>
+
+static const uint32_t ring_version = 1;
+static const int spin_iterations = 4000; // A few microseconds before falling back to the futex
+
+static size_t round_up(size_t n, size_t to)
+{
+	return (n + to - 1) / to * to;
+}
+
+// Shared, not FUTEX_PRIVATE, since the other side is a different process
+static long futex(std::atomic<uint32_t> &word, int op, uint32_t value, const timespec *timeout)
+{
+	return syscall(SYS_futex, (uint32_t *)&word, op, value, timeout, nullptr, 0);
+}
+
+ShmRing::ShmRing(const std::string &name, bool create, uint32_t slots, uint32_t slot_size)
+	: m_name(name), m_owner(create), m_interrupted(false)
+{
+	const int fd = create ? shm_open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600) : shm_open(name.c_str(), O_RDWR, 0);
+	if (fd < 0)
+	{
+		printf("Could not open shared memory '%s': %s\n", name.c_str(), strerror(errno));
+		return;
+	}
+
+	if (create)
+	{
+		uint32_t slot_count = 1;
+		while (slot_count < slots)
+			slot_count <<= 1;
+
+		m_slot_count = slot_count;
+		m_slot_size = slot_size;
+		m_slot_stride = round_up(offsetof(ShmSlot, data) + slot_size, 64);
+		m_map_size = round_up(sizeof(Header), 64) + m_slot_stride * m_slot_count;
+		if (ftruncate(fd, m_map_size) != 0)
+		{
+			close(fd);
+			return;
+		}
+	}
+	else
+	{
+		struct stat info;
+		if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(Header))
+		{
+			close(fd);
+			return;
+		}
+		m_map_size = info.st_size;
+	}
+
+	void *map = mmap(nullptr, m_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return;
+
+	Header *header = (Header *)map;
+	if (create)
+	{
+		header = new (map) Header();
+		memcpy(header->magic, "NNSR", 4);
+		header->version = ring_version;
+		header->slots = m_slot_count;
+		header->slot_size = m_slot_size;
+		header->head = 0;
+		header->consumer_waiting = 0;
+		header->tail = 0;
+		header->producer_waiting = 0;
+	}
+	else
+	{
+		m_slot_count = header->slots;
+		m_slot_size = header->slot_size;
+		m_slot_stride = round_up(offsetof(ShmSlot, data) + m_slot_size, 64);
+
+		const bool valid = memcmp(header->magic, "NNSR", 4) == 0 && header->version == ring_version && m_slot_count && !(m_slot_count & (m_slot_count - 1));
+		if (!valid || round_up(sizeof(Header), 64) + m_slot_stride * m_slot_count > m_map_size)
+		{
+			printf("'%s' is not a frame ring\n", name.c_str());
+			munmap(map, m_map_size);
+			return;
+		}
+	}
+
+	m_header = header;
+	m_slots = (uint8_t *)map + round_up(sizeof(Header), 64);
+}
+
+ShmRing::~ShmRing()
+{
+	if (m_header)
+		munmap(m_header, m_map_size);
+	if (m_owner)
+		shm_unlink(m_name.c_str());
+}
+
+// Waits while word still holds busy_value. The waiting flag is raised before the final
+// check, and the other side lowers the word before reading the flag, so a wake can't slip
+// between the check and the sleep, and futex itself refuses to sleep on a changed word
+bool ShmRing::wait_for(std::atomic<uint32_t> &word, std::atomic<uint32_t> &waiting, uint32_t busy_value, int64_t timeout_us)
+{
+	for (int i = 0; i < spin_iterations; i++)
+	{
+		if (word.load(std::memory_order_acquire) != busy_value)
+			return true;
+		if (m_interrupted)
+			return false;
+	}
+
+	timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (;;)
+	{
+		waiting.store(1);
+		if (word.load() != busy_value)
+			return true;
+		if (m_interrupted)
+			return false;
+
+		timespec timeout = {1, 0}; // Rechecks the interrupt flag now and then
+		if (timeout_us >= 0)
+		{
+			timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			const int64_t left_us = timeout_us - (now.tv_sec - start.tv_sec) * 1000000 - (now.tv_nsec - start.tv_nsec) / 1000;
+			if (left_us <= 0)
+				return false;
+			if (left_us < 1000000)
+				timeout = {0, (long)left_us * 1000};
+		}
+		futex(word, FUTEX_WAIT, busy_value, &timeout);
+	}
+}
+
+void ShmRing::wake(std::atomic<uint32_t> &word, std::atomic<uint32_t> &waiting)
+{
+	if (waiting.load() && waiting.exchange(0))
+		futex(word, FUTEX_WAKE, INT32_MAX, nullptr);
+}
+
+uint8_t *ShmRing::begin_write(int64_t timeout_us)
+{
+	if (!m_header)
+		return nullptr;
+
+	const uint32_t head = m_header->head.load(std::memory_order_relaxed);
+	if (head - m_header->tail.load(std::memory_order_acquire) == m_slot_count && !wait_for(m_header->tail, m_header->producer_waiting, head - m_slot_count, timeout_us))
+		return nullptr;
+	return slot(head)->data;
+}
+
+void ShmRing::end_write(uint32_t id, uint8_t format, uint32_t size)
+{
+	const uint32_t head = m_header->head.load(std::memory_order_relaxed);
+	ShmSlot *written = slot(head);
+	written->id = id;
+	written->format = format;
+	written->size = size;
+
+	m_header->head.store(head + 1);
+	wake(m_header->head, m_header->consumer_waiting);
+}
+
+const ShmSlot *ShmRing::begin_read(int64_t timeout_us)
+{
+	if (!m_header)
+		return nullptr;
+
+	const uint32_t tail = m_header->tail.load(std::memory_order_relaxed);
+	if (m_header->head.load(std::memory_order_acquire) == tail && !wait_for(m_header->head, m_header->consumer_waiting, tail, timeout_us))
+		return nullptr;
+	return slot(tail);
+}
+
+void ShmRing::end_read()
+{
+	m_header->tail.store(m_header->tail.load(std::memory_order_relaxed) + 1);
+	wake(m_header->tail, m_header->producer_waiting);
+}
+
+void ShmRing::interrupt()
+{
+	m_interrupted = true;
+	if (m_header)
+	{
+		futex(m_header->head, FUTEX_WAKE, INT32_MAX, nullptr);
+		futex(m_header->tail, FUTEX_WAKE, INT32_MAX, nullptr);
+	}
+}
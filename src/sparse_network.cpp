@@ -0,0 +1,122 @@
+#include "sparse_network.h"
+
+const uint16_t dense_fraction = 2; // Inputs keeping at least 1 / dense_fraction of their weights are stored whole
+
+SparseNetwork::SparseNetwork(const NeuralNetwork &net)
+	: m_input(net.m_input), m_hidden(net.m_hidden), m_output(net.m_output), m_activation(net.m_activation->forward)
+{
+	for (uint16_t k = 0; k < m_input; k++)
+	{
+		uint16_t kept = 0;
+		for (uint16_t i = 0; i < m_hidden; i++)
+		{
+			kept += net.m_hidden_weights.m_entries[i][k] != 0;
+		}
+		if (kept == 0)
+			continue;
+
+		// Mostly kept inputs are cheaper as a plain run the compiler can vectorise, zeros and all
+		const bool dense = kept * dense_fraction >= m_hidden;
+		m_live_inputs.push_back(k);
+		m_starts.push_back(m_values.size());
+		for (uint16_t i = 0; i < m_hidden; i++)
+		{
+			const double weight = net.m_hidden_weights.m_entries[i][k];
+			if (weight == 0 && !dense)
+				continue;
+			m_nodes.push_back(i);
+			m_values.push_back(weight);
+		}
+	}
+	m_starts.push_back(m_values.size());
+
+	m_output_weights.resize((size_t)m_hidden * m_output);
+	for (uint16_t i = 0; i < m_hidden; i++)
+	{
+		for (uint16_t j = 0; j < m_output; j++)
+		{
+			m_output_weights[(size_t)i * m_output + j] = net.m_output_weights.m_entries[j][i];
+		}
+	}
+}
+
+size_t SparseNetwork::footprint() const
+{
+	return m_live_inputs.size() * sizeof(uint16_t) + m_starts.size() * sizeof(uint32_t) + m_nodes.size() * sizeof(uint16_t) +
+		   m_values.size() * sizeof(double) + m_output_weights.size() * sizeof(double);
+}
+
+void SparseNetwork::forward(const double *input, double *output) const
+{
+	// Sized on a thread's first call and reused after that
+	static thread_local std::vector<double> hidden_calculations;
+	hidden_calculations.assign(m_hidden, 0);
+
+	for (size_t n = 0; n < m_live_inputs.size(); n++)
+	{
+		const double x = input[m_live_inputs[n]];
+		const uint32_t start = m_starts[n];
+		const uint32_t end = m_starts[n + 1];
+		if (end - start == m_hidden)
+		{
+			const double *weights = &m_values[start];
+			double *hidden = hidden_calculations.data();
+			for (uint16_t i = 0; i < m_hidden; i++)
+			{
+				hidden[i] += weights[i] * x;
+			}
+			continue;
+		}
+
+		for (uint32_t e = start; e < end; e++)
+		{
+			hidden_calculations[m_nodes[e]] += m_values[e] * x;
+		}
+	}
+
+	for (uint16_t j = 0; j < m_output; j++)
+	{
+		output[j] = 0;
+	}
+	for (uint16_t i = 0; i < m_hidden; i++)
+	{
+		const double h = m_activation(hidden_calculations[i]);
+		const double *weights = &m_output_weights[(size_t)i * m_output];
+		for (uint16_t j = 0; j < m_output; j++)
+		{
+			output[j] += weights[j] * h;
+		}
+	}
+	for (uint16_t j = 0; j < m_output; j++)
+	{
+		output[j] = m_activation(output[j]);
+	}
+}
+
+uint32_t SparseNetwork::predict(const double *input) const
+{
+	static thread_local std::vector<double> output;
+	output.resize(m_output);
+	forward(input, output.data());
+
+	uint32_t max_idx = 0;
+	for (uint32_t j = 1; j < m_output; j++)
+	{
+		if (output[j] > output[max_idx])
+			max_idx = j;
+	}
+	return max_idx;
+}
+
+double SparseNetwork::score(const Dataset &dataset) const
+{
+	if (dataset.features() != m_input || dataset.size() == 0)
+		return 0;
+
+	size_t n_correct = 0;
+	for (size_t i = 0; i < dataset.size(); i++)
+	{
+		n_correct += predict(dataset.sample(i)) == dataset.label(i);
+	}
+	return 1.0 * n_correct / dataset.size();
+}
@@ -0,0 +1,124 @@
+#include "thread_pool.h"
+
+static std::atomic<unsigned> shared_threads(0);
+
+ThreadPool::ThreadPool(unsigned n_helpers) : m_free(n_helpers)
+{
+	m_posted.reserve(n_helpers);
+	for (unsigned i = 0; i < n_helpers; i++)
+	{
+		m_threads.push_back(std::thread(&ThreadPool::helper_loop, this));
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+	m_job_posted.notify_all();
+
+	for (std::thread &th : m_threads)
+	{
+		th.join();
+	}
+}
+
+ThreadPool &ThreadPool::shared()
+{
+	static ThreadPool pool((shared_threads ? shared_threads.load() : std::max(1u, std::thread::hardware_concurrency())) - 1);
+	return pool;
+}
+
+void ThreadPool::set_shared_threads(unsigned n_threads)
+{
+	shared_threads = std::max(1u, n_threads);
+}
+
+unsigned ThreadPool::reserve(unsigned n)
+{
+	int free = m_free.load();
+	while (free > 0 && n)
+	{
+		const int take = std::min<int>(free, n);
+		if (m_free.compare_exchange_weak(free, free - take))
+			return take;
+	}
+	return 0;
+}
+
+void ThreadPool::release(unsigned n)
+{
+	m_free += n;
+}
+
+void ThreadPool::run(Job &job, unsigned wanted)
+{
+	// Only helpers that are free right now are asked, whatever they don't take the caller does
+	const unsigned claimed = reserve(wanted);
+	if (claimed)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			job.helpers_left = claimed;
+			m_posted.insert(m_posted.end(), claimed, &job);
+		}
+		if (claimed == 1)
+			m_job_posted.notify_one();
+		else
+			m_job_posted.notify_all();
+	}
+
+	work_on(job);
+
+	if (claimed)
+	{
+		// Entries no helper has picked up yet would only find the job finished
+		std::unique_lock<std::mutex> lock(m_mutex);
+		for (size_t i = m_posted.size(); i-- > 0;)
+		{
+			if (m_posted[i] != &job)
+				continue;
+			m_posted.erase(m_posted.begin() + i);
+			job.helpers_left--;
+		}
+		m_job_done.wait(lock, [&]
+						{ return job.helpers_left == 0; });
+	}
+	release(claimed);
+}
+
+void ThreadPool::work_on(Job &job)
+{
+	for (size_t begin = job.next.fetch_add(job.grain); begin < job.n; begin = job.next.fetch_add(job.grain))
+	{
+		job.run(job.context, begin, std::min(job.n, begin + job.grain));
+	}
+}
+
+void ThreadPool::helper_loop()
+{
+	for (;;)
+	{
+		Job *job;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_job_posted.wait(lock, [&]
+							  { return !m_posted.empty() || m_stopping; });
+			if (m_posted.empty())
+				return;
+
+			job = m_posted.back();
+			m_posted.pop_back();
+		}
+		work_on(*job);
+
+		// The caller may return as soon as this lands, so job isn't touched afterwards
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			job->helpers_left--;
+		}
+		m_job_done.notify_all();
+	}
+}
@@ -0,0 +1,210 @@
+#include "trainer.h"
+#include <algorithm>
+
+ValidationCallback::ValidationCallback(const std::vector<Img> &imgs, uint16_t interval, score_callback_t on_score)
+	: m_inputs(stack_imgs(imgs)), m_labels(stack_labels(imgs)), m_interval(interval), m_on_score(on_score) {}
+
+ValidationCallback::ValidationCallback(const Matrix &inputs, const std::vector<bool> &labels, uint16_t interval, score_callback_t on_score)
+	: m_inputs(inputs), m_labels(labels), m_interval(interval), m_on_score(on_score) {}
+
+void ValidationCallback::on_epoch_end(NeuralNetwork &net, TrainingState &state)
+{
+	if (m_interval == 0 || state.epoch % m_interval != 0)
+		return;
+
+	state.score = net.score_batch(m_inputs, m_labels);
+	state.score_epoch = state.epoch;
+	state.validated = true;
+
+	if (state.score > state.best_score || state.best_epoch == 0)
+	{
+		state.best_score = state.score;
+		state.best_epoch = state.epoch;
+	}
+
+	if (m_on_score)
+		m_on_score(state);
+}
+
+ValidationWorker::ValidationWorker(unsigned n_threads)
+{
+	for (unsigned i = 0; i < std::max(1u, n_threads); i++)
+	{
+		m_threads.push_back(std::thread(&ValidationWorker::worker_loop, this));
+	}
+}
+
+ValidationWorker::~ValidationWorker()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+	m_job_added.notify_all();
+
+	for (std::thread &th : m_threads)
+	{
+		th.join();
+	}
+}
+
+std::future<double> ValidationWorker::submit(std::shared_ptr<const WeightSnapshot> snapshot, const Matrix &inputs, const std::vector<bool> &labels)
+{
+	std::packaged_task<double()> job([snapshot, &inputs, &labels]
+									 { return NeuralNetwork::score_weights(snapshot->hidden_weights, snapshot->output_weights, inputs, labels, *snapshot->activation); });
+	std::future<double> score = job.get_future();
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_jobs.push_back(std::move(job));
+	}
+	m_job_added.notify_one();
+	return score;
+}
+
+void ValidationWorker::worker_loop()
+{
+	for (;;)
+	{
+		std::packaged_task<double()> job;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_job_added.wait(lock, [&]
+							 { return !m_jobs.empty() || m_stopping; });
+
+			// Jobs still queued at shutdown are run so nobody waits on a broken future
+			if (m_jobs.empty())
+				return;
+
+			job = std::move(m_jobs.front());
+			m_jobs.pop_front();
+		}
+		job();
+	}
+}
+
+AsyncValidationCallback::AsyncValidationCallback(ValidationWorker &worker, const Matrix &inputs, const std::vector<bool> &labels, uint16_t interval,
+												 score_callback_t on_score, bool restore_best)
+	: m_worker(worker), m_inputs(inputs), m_labels(labels), m_interval(interval), m_on_score(on_score), m_restore_best(restore_best) {}
+
+void AsyncValidationCallback::on_train_begin(NeuralNetwork &net, TrainingState &state)
+{
+	m_pending.clear();
+	m_best.reset();
+}
+
+void AsyncValidationCallback::fold(TrainingState &state)
+{
+	Pending &pending = m_pending.front();
+	state.score = pending.score.get();
+	state.score_epoch = pending.epoch;
+	state.validated = true;
+
+	if (state.score > state.best_score || state.best_epoch == 0)
+	{
+		state.best_score = state.score;
+		state.best_epoch = pending.epoch;
+		m_best = pending.snapshot;
+	}
+
+	m_pending.pop_front();
+
+	if (m_on_score)
+		m_on_score(state);
+}
+
+void AsyncValidationCallback::on_epoch_end(NeuralNetwork &net, TrainingState &state)
+{
+	if (m_interval == 0 || state.epoch % m_interval != 0)
+		return;
+
+	while (!m_pending.empty())
+		fold(state);
+
+	std::shared_ptr<WeightSnapshot> snapshot(new WeightSnapshot{net.m_hidden_weights, net.m_output_weights, net.m_activation});
+	std::future<double> score = m_worker.submit(snapshot, m_inputs, m_labels);
+	m_pending.push_back({state.epoch, snapshot, std::move(score)});
+}
+
+void AsyncValidationCallback::on_train_end(NeuralNetwork &net, TrainingState &state)
+{
+	while (!m_pending.empty())
+		fold(state);
+
+	if (!m_restore_best || !m_best)
+		return;
+
+	net.m_hidden_weights = m_best->hidden_weights;
+	net.m_output_weights = m_best->output_weights;
+}
+
+EarlyStopping::EarlyStopping(uint16_t patience, double min_delta) : m_patience(patience), m_min_delta(min_delta) {}
+
+void EarlyStopping::on_train_begin(NeuralNetwork &net, TrainingState &state)
+{
+	m_wait = 0;
+	m_best = -1.0;
+}
+
+void EarlyStopping::on_epoch_end(NeuralNetwork &net, TrainingState &state)
+{
+	if (!state.validated)
+		return;
+
+	if (state.score > m_best + m_min_delta)
+	{
+		m_best = state.score;
+		m_wait = 0;
+		return;
+	}
+
+	if (++m_wait >= m_patience)
+		state.stop = true;
+}
+
+void BestCheckpoint::on_train_begin(NeuralNetwork &net, TrainingState &state)
+{
+	m_has_checkpoint = false;
+}
+
+void BestCheckpoint::on_epoch_end(NeuralNetwork &net, TrainingState &state)
+{
+	if (!state.validated || state.best_epoch != state.epoch)
+		return;
+
+	m_hidden_weights = net.m_hidden_weights;
+	m_output_weights = net.m_output_weights;
+	m_has_checkpoint = true;
+}
+
+void BestCheckpoint::on_train_end(NeuralNetwork &net, TrainingState &state)
+{
+	if (!m_restore_on_end || !m_has_checkpoint)
+		return;
+
+	net.m_hidden_weights = m_hidden_weights;
+	net.m_output_weights = m_output_weights;
+}
+
+TrainingState Trainer::fit(uint16_t max_epochs, uint16_t batch_size, double learning_rate)
+{
+	TrainingState state;
+
+	for (TrainingCallback *callback : m_callbacks)
+		callback->on_train_begin(m_net, state);
+
+	while (state.epoch < max_epochs && !state.stop)
+	{
+		m_net.train_model(m_dataset, 1, batch_size, learning_rate, m_shuffle_rng);
+		state.epoch++;
+		state.validated = false;
+
+		for (TrainingCallback *callback : m_callbacks)
+			callback->on_epoch_end(m_net, state);
+	}
+
+	for (TrainingCallback *callback : m_callbacks)
+		callback->on_train_end(m_net, state);
+
+	return state;
+}
@@ -0,0 +1,278 @@
+#include "tuner.h"
+#include "trainer.h"
+#include <algorithm>
+#include <atomic>
+#include <math.h>
+#include <stdio.h>
+#include <thread>
+#include <unistd.h>
+
+// A quarter of the threads score snapshots and the rest train. With a single thread there
+// is nothing to split, so its validator shares the one core with training
+static unsigned validator_threads(unsigned n_threads)
+{
+	return std::max(1u, n_threads / 4);
+}
+
+static unsigned training_threads(unsigned n_threads)
+{
+	return n_threads > validator_threads(n_threads) ? n_threads - validator_threads(n_threads) : 1;
+}
+
+Tuner::Tuner(const SearchSpace &space, const Dataset &train_set, const std::vector<Img> &test_imgs,
+			 unsigned n_threads, uint64_t seed)
+	: m_space(space), m_train_set(train_set), m_test_inputs(stack_imgs(test_imgs)), m_test_labels(stack_labels(test_imgs)),
+	  m_n_threads(training_threads(n_threads)), m_validator(validator_threads(n_threads)),
+	  m_validator_cores(ThreadPool::shared(), validator_threads(n_threads)), m_seed(seed), m_rng(seed)
+{
+	const size_t nodes = NumaTopology::get().nodes();
+	m_replicas.resize(nodes);
+	m_replica_once.reset(new std::once_flag[std::max<size_t>(1, nodes)]);
+}
+
+// Built by the first worker to arrive on the node, so without libnuma first touch still puts it there
+const Dataset &Tuner::train_set_on(int node)
+{
+	if (node < 0)
+		return m_train_set;
+
+	std::call_once(m_replica_once[node], [&]
+				   { m_replicas[node].reset(new Dataset(m_train_set, node)); });
+	return *m_replicas[node];
+}
+
+hyperparameters Tuner::sample()
+{
+	hyperparameters hp;
+	hp.hidden_nodes = m_space.hidden_nodes[m_rng.below(m_space.hidden_nodes.size())];
+	hp.batch_size = m_space.batch_sizes[m_rng.below(m_space.batch_sizes.size())];
+	hp.learning_rate = exp(m_rng.uniform(log(m_space.min_learning_rate), log(m_space.max_learning_rate)));
+	hp.epochs = m_space.min_epochs + m_rng.below(m_space.max_epochs - m_space.min_epochs + 1);
+	return hp;
+}
+
+std::vector<Tuner::Trial> Tuner::create_trials(uint32_t n_trials)
+{
+	std::vector<Trial> trials(n_trials);
+	for (Trial &trial : trials)
+	{
+		trial.id = m_next_id++;
+		trial.params = sample();
+		trial.shuffle_rng = Rng::stream(m_seed, trial.id, Shuffle);
+	}
+	return trials;
+}
+
+void Tuner::run_rung(std::vector<Trial *> &trials, uint16_t target_epochs, bool early_stopping)
+{
+	const NumaTopology &topology = NumaTopology::get();
+	const size_t n_threads = std::min<size_t>(m_n_threads, trials.size());
+
+	// One queue per node. Trials go back to the node their weights were built on and new
+	// ones are dealt out round robin, a worker drains its own node's queue before stealing.
+	// With a single node this is one queue in the original order
+	const size_t n_queues = std::max<size_t>(1, std::min(topology.nodes(), n_threads));
+	std::vector<std::vector<Trial *>> queues(n_queues);
+	for (size_t i = 0; i < trials.size(); i++)
+	{
+		const int node = trials[i]->node;
+		queues[node >= 0 && (size_t)node < n_queues ? node : i % n_queues].push_back(trials[i]);
+	}
+	std::unique_ptr<std::atomic<size_t>[]> next_trial(new std::atomic<size_t>[n_queues]);
+	for (size_t q = 0; q < n_queues; q++)
+	{
+		next_trial[q] = 0;
+	}
+
+	auto worker = [&](unsigned index)
+	{
+		const int node = n_queues > 1 && topology.pin_to_node(topology.node_for_worker(index)) ? topology.node_for_worker(index) : -1;
+		const Dataset &train_set = train_set_on(node);
+
+		for (size_t offset = 0; offset < n_queues; offset++)
+		{
+			std::vector<Trial *> &queue = queues[(std::max(node, 0) + offset) % n_queues];
+			std::atomic<size_t> &next = next_trial[(std::max(node, 0) + offset) % n_queues];
+
+			for (size_t i = next++; i < queue.size(); i = next++)
+			{
+				Trial &trial = *queue[i];
+				const uint16_t target = std::min(target_epochs, trial.params.epochs);
+
+				// Weights depend only on (seed, id), so it doesn't matter which worker builds them
+				if (!trial.net)
+				{
+					trial.net.reset(new NeuralNetwork(train_set.features(), trial.params.hidden_nodes, 2, m_seed, trial.id));
+					trial.node = node;
+				}
+
+				Trainer trainer(*trial.net, train_set);
+				trainer.set_shuffle(&trial.shuffle_rng);
+
+				if (early_stopping)
+				{
+					AsyncValidationCallback validation(m_validator, m_test_inputs, m_test_labels, validation_interval, [&](const TrainingState &state)
+													   {
+														   if (!m_on_result)
+															   return;
+														   hyperparameters scored = trial.params;
+														   scored.epochs = state.score_epoch;
+														   m_on_result({trial.id, scored, state.score}); });
+					EarlyStopping stopping(early_stopping_patience);
+
+					trainer.add_callback(&validation);
+					trainer.add_callback(&stopping);
+					TrainingState state = trainer.fit(target, trial.params.batch_size, trial.params.learning_rate);
+
+					// The validation callback has already rolled the weights back to the best validated epoch
+					trial.epochs_trained = state.best_epoch ? state.best_epoch : state.epoch;
+					trial.score = state.best_epoch ? state.best_score : trial.net->score_batch(m_test_inputs, m_test_labels);
+					continue;
+				}
+
+				trainer.fit(target - trial.epochs_trained, trial.params.batch_size, trial.params.learning_rate);
+				trial.epochs_trained = target;
+
+				// Scored on the validation worker while this thread moves on to the next trial
+				std::shared_ptr<WeightSnapshot> snapshot(new WeightSnapshot{trial.net->m_hidden_weights, trial.net->m_output_weights, trial.net->m_activation});
+				trial.pending_score = m_validator.submit(snapshot, m_test_inputs, m_test_labels);
+			}
+		}
+	};
+
+	// Every worker keeps a core busy. This thread only waits, so its own core goes to one of
+	// them and the rest come out of the shared pool, leaving intra-op helpers just what's left
+	CoreReservation cores(ThreadPool::shared(), n_threads ? n_threads - 1 : 0);
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < n_threads; i++)
+	{
+		threads.push_back(std::thread(worker, i));
+	}
+
+	for (std::thread &th : threads)
+	{
+		th.join();
+	}
+
+	for (Trial *trial : trials)
+	{
+		hyperparameters scored = trial->params;
+		scored.epochs = trial->epochs_trained;
+
+		if (trial->pending_score.valid())
+		{
+			trial->score = trial->pending_score.get();
+			if (m_on_result)
+				m_on_result({trial->id, scored, trial->score});
+		}
+		m_results.push_back({trial->id, scored, trial->score});
+	}
+}
+
+std::vector<TrialResult> Tuner::run_halving(std::vector<Trial> &trials, uint16_t min_epochs, uint16_t eta)
+{
+	std::vector<Trial *> alive;
+	for (Trial &trial : trials)
+	{
+		trial.params.epochs = m_space.max_epochs;
+		alive.push_back(&trial);
+	}
+
+	std::vector<TrialResult> rung_results;
+	uint32_t rung_epochs = std::max<uint16_t>(1, min_epochs);
+
+	for (;;)
+	{
+		const uint16_t target = std::min<uint32_t>(rung_epochs, m_space.max_epochs);
+		run_rung(alive, target);
+
+		std::stable_sort(alive.begin(), alive.end(), [](const Trial *a, const Trial *b)
+						 { return a->score > b->score; });
+
+		if (alive.size() == 1 || target == m_space.max_epochs)
+			break;
+
+		// Losers give their weights back straight away rather than at the end of the bracket
+		const size_t survivors = std::max<size_t>(1, alive.size() / eta);
+		for (size_t i = survivors; i < alive.size(); i++)
+		{
+			alive[i]->net.reset();
+		}
+		alive.resize(survivors);
+		rung_epochs *= eta;
+	}
+
+	for (const Trial *trial : alive)
+	{
+		rung_results.push_back({trial->id, trial->params, trial->score});
+		rung_results.back().params.epochs = trial->epochs_trained;
+	}
+	return rung_results;
+}
+
+std::vector<TrialResult> Tuner::random_search(uint32_t n_trials)
+{
+	std::vector<Trial> trials = create_trials(n_trials);
+	std::vector<Trial *> alive;
+	for (Trial &trial : trials)
+	{
+		alive.push_back(&trial);
+	}
+
+	run_rung(alive, m_space.max_epochs, true);
+
+	std::vector<TrialResult> results(m_results.end() - n_trials, m_results.end());
+	std::stable_sort(results.begin(), results.end(), [](const TrialResult &a, const TrialResult &b)
+					 { return a.score > b.score; });
+	return results;
+}
+
+std::vector<TrialResult> Tuner::successive_halving(uint32_t n_trials, uint16_t min_epochs, uint16_t eta)
+{
+	std::vector<Trial> trials = create_trials(n_trials);
+	return run_halving(trials, min_epochs, std::max<uint16_t>(2, eta));
+}
+
+std::vector<TrialResult> Tuner::hyperband(uint16_t eta)
+{
+	eta = std::max<uint16_t>(2, eta);
+	const uint16_t min_epochs = std::max<uint16_t>(1, m_space.min_epochs);
+	const double max_resource = 1.0 * m_space.max_epochs / min_epochs;
+	const int s_max = floor(log(max_resource) / log(eta) + 1e-9);
+
+	std::vector<TrialResult> best;
+	for (int s = s_max; s >= 0; s--)
+	{
+		const uint32_t n_trials = ceil((s_max + 1.0) / (s + 1.0) * pow(eta, s));
+		const uint16_t bracket_epochs = std::max(1.0, m_space.max_epochs / pow(eta, s));
+
+		std::vector<Trial> trials = create_trials(n_trials);
+		std::vector<TrialResult> bracket = run_halving(trials, bracket_epochs, eta);
+		best.insert(best.end(), bracket.begin(), bracket.end());
+	}
+
+	std::stable_sort(best.begin(), best.end(), [](const TrialResult &a, const TrialResult &b)
+					 { return a.score > b.score; });
+	return best;
+}
+
+bool Tuner::save_results(const std::string &file_string) const
+{
+	const std::string tmp_string = file_string + ".tmp";
+	FILE *file = fopen(tmp_string.c_str(), "w");
+	if (!file)
+		return false;
+
+	fprintf(file, "Trial, Score, Hidden_nodes, Epochs, Learning_rate, Batch_size\n");
+	for (const TrialResult &result : m_results)
+	{
+		fprintf(file, "%u, %1.5f, %d, %d, %1.5f, %d\n", result.id, result.score, result.params.hidden_nodes,
+				result.params.epochs, result.params.learning_rate, result.params.batch_size);
+	}
+
+	fflush(file);
+	fsync(fileno(file));
+	fclose(file);
+
+	return rename(tmp_string.c_str(), file_string.c_str()) == 0;
+}
@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+#include <vector>
+
+#include "nn.h"
+#include "thread_pool.h"
+
+// Every allocation in the process goes through here while the test runs
+std::atomic<size_t> n_allocations(0);
+
+void *operator new(size_t size)
+{
+	n_allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void *ptr = malloc(size ? size : 1))
+		return ptr;
+	throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+	free(ptr);
+}
+
+// Random 8x8 images, the training data itself doesn't matter for counting allocations
+std::vector<Img> make_imgs(size_t n_imgs, Rng &rng)
+{
+	std::vector<Img> imgs(n_imgs);
+	for (Img &img : imgs)
+	{
+		img.img_data = Matrix(8, 8);
+		for (int i = 0; i < 8; i++)
+		{
+			for (int j = 0; j < 8; j++)
+			{
+				img.img_data.m_entries[i][j] = rng.uniform(0, 255);
+			}
+		}
+		img.label = rng.uniform(0, 1) < 0.5;
+	}
+	return imgs;
+}
+
+// One warm up epoch sizes the scratch arenas, after which a whole epoch must not allocate
+bool check_training(const char *name, const Dataset &dataset, int hidden, uint16_t batch_size)
+{
+	NeuralNetwork net(dataset.features(), hidden, 2);
+	net.train_model(dataset, 1, batch_size, 0.15);
+
+	const size_t allocations_before = n_allocations;
+	net.train_model(dataset, 1, batch_size, 0.15);
+	const size_t allocations = n_allocations - allocations_before;
+
+	printf("%s: %zu allocations in a warm epoch\n", name, allocations);
+	return allocations == 0;
+}
+
+int main()
+{
+	// Enough threads that large layers take the intra-op path even on a single core box
+	ThreadPool::set_shared_threads(4);
+
+	Rng rng(42);
+	const Dataset dataset(make_imgs(64, rng));
+
+	bool ok = true;
+	ok &= check_training("serial", dataset, 200, 1);
+	ok &= check_training("mini-batch", dataset, 200, 16);
+	ok &= check_training("intra-op parallel", dataset, 2000, 1);
+
+	if (!ok)
+		printf("Warm training reached the heap\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "inference_server.h"
+#include "nn.h"
+#include "preprocess.h"
+
+// A client of the socket protocol. Reads give up after a few seconds so a lost reply fails
+// the test instead of hanging it
+int connect_client(const std::string &path)
+{
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	timeval timeout = {5, 0};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+	if (connect(fd, (sockaddr *)&address, sizeof(address)) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+bool send_request(int fd, uint32_t id, InferenceFormat format, const std::vector<uint8_t> &payload)
+{
+	InferenceRequestHeader header = {id, format, (uint32_t)payload.size()};
+	std::vector<uint8_t> request((uint8_t *)&header, (uint8_t *)&header + sizeof(header));
+	request.insert(request.end(), payload.begin(), payload.end());
+	return send(fd, request.data(), request.size(), MSG_NOSIGNAL) == (ssize_t)request.size();
+}
+
+void append_u32(std::vector<uint8_t> &out, uint32_t value)
+{
+	for (int shift = 24; shift >= 0; shift -= 8)
+		out.push_back(value >> shift);
+}
+
+void append_chunk(std::vector<uint8_t> &png, const char *type, const std::vector<uint8_t> &data)
+{
+	append_u32(png, data.size());
+	const size_t start = png.size();
+	png.insert(png.end(), type, type + 4);
+	png.insert(png.end(), data.begin(), data.end());
+
+	uint32_t crc = 0xFFFFFFFF;
+	for (size_t i = start; i < png.size(); i++)
+	{
+		crc ^= png[i];
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+	}
+	append_u32(png, ~crc);
+}
+
+// An 8 bit greyscale PNG, white with a dark square of side `part` in the middle, stored
+// uncompressed so the test needs no deflate of its own
+std::vector<uint8_t> make_png(uint32_t width, uint32_t height, uint32_t part)
+{
+	std::vector<uint8_t> scanlines;
+	for (uint32_t y = 0; y < height; y++)
+	{
+		scanlines.push_back(0); // No filter
+		for (uint32_t x = 0; x < width; x++)
+		{
+			const bool dark = x >= (width - part) / 2 && x < (width + part) / 2 && y >= (height - part) / 2 && y < (height + part) / 2;
+			scanlines.push_back(dark ? 20 : 255);
+		}
+	}
+
+	std::vector<uint8_t> header;
+	append_u32(header, width);
+	append_u32(header, height);
+	header.insert(header.end(), {8, 0, 0, 0, 0}); // Depth 8, greyscale, no interlace
+
+	std::vector<uint8_t> zlib = {0x78, 0x01, 0x01, uint8_t(scanlines.size()), uint8_t(scanlines.size() >> 8),
+								 uint8_t(~scanlines.size()), uint8_t(~scanlines.size() >> 8)};
+	zlib.insert(zlib.end(), scanlines.begin(), scanlines.end());
+	uint32_t a = 1, b = 0;
+	for (uint8_t byte : scanlines)
+	{
+		a = (a + byte) % 65521;
+		b = (b + a) % 65521;
+	}
+	append_u32(zlib, (b << 16) | a);
+
+	std::vector<uint8_t> png = {137, 80, 78, 71, 13, 10, 26, 10};
+	append_chunk(png, "IHDR", header);
+	append_chunk(png, "IDAT", zlib);
+	append_chunk(png, "IEND", {});
+	return png;
+}
+
+// Reads until the server closes the connection or max_bytes have arrived
+std::vector<uint8_t> receive(int fd, size_t max_bytes)
+{
+	std::vector<uint8_t> received;
+	uint8_t buffer[256];
+	while (received.size() < max_bytes)
+	{
+		const ssize_t count = recv(fd, buffer, sizeof(buffer), 0);
+		if (count <= 0)
+			break;
+		received.insert(received.end(), buffer, buffer + count);
+	}
+	return received;
+}
+
+// Each id must come back once, answered as expected[id]
+bool check_replies(const char *name, const std::vector<uint8_t> &received, const std::vector<InferenceResponse> &expected)
+{
+	std::vector<bool> seen(expected.size(), false);
+	bool ok = received.size() == expected.size() * sizeof(InferenceResponse);
+	for (size_t i = 0; ok && i < expected.size(); i++)
+	{
+		InferenceResponse response;
+		memcpy(&response, received.data() + i * sizeof(response), sizeof(response));
+		ok = response.id < expected.size() && !seen[response.id];
+		if (!ok)
+			break;
+
+		const InferenceResponse &wanted = expected[response.id];
+		seen[response.id] = true;
+		ok = response.status == wanted.status && response.label == wanted.label && response.score == wanted.score;
+	}
+	printf("%s: %zu of %zu replies%s\n", name, received.size() / sizeof(InferenceResponse), expected.size(), ok ? "" : ", FAILED");
+	return ok;
+}
+
+int main()
+{
+	// ~100KB, so it lives on the heap like the one main.cpp serves
+	NeuralNetwork trained(64, 200, 2);
+	std::unique_ptr<deployed_network_t> net(new deployed_network_t());
+	net->load(trained);
+
+	std::vector<uint8_t> pixels[2] = {std::vector<uint8_t>(64), std::vector<uint8_t>(64)};
+	for (int i = 0; i < 64; i++)
+	{
+		pixels[0][i] = i * 4;
+		pixels[1][i] = 255 - i * 4;
+	}
+	const std::vector<InferenceResponse> raw_replies = {InferenceServer::classify(*net, 0, pixels[0].data()),
+														InferenceServer::classify(*net, 1, pixels[1].data())};
+
+	ServerConfig config;
+	config.socket_path = "/tmp/nn_serve_test_" + std::to_string(getpid()) + ".sock";
+	InferenceServer server(*net, config, preprocess::condense_request);
+	if (!server.start())
+		return 1;
+	std::thread serving([&server]
+						{ server.run(); });
+
+	bool ok = true;
+
+	// A client that keeps its connection open and reads each reply as it needs it
+	int fd = connect_client(config.socket_path);
+	ok &= fd >= 0 && send_request(fd, 0, RawPixels, pixels[0]);
+	ok &= check_replies("open connection", receive(fd, sizeof(InferenceResponse)), {raw_replies[0]});
+	close(fd);
+
+	// A client that sends everything, shuts down its sending side and reads until the server
+	// hangs up, which it must only do once every request is answered
+	fd = connect_client(config.socket_path);
+	ok &= fd >= 0 && send_request(fd, 0, RawPixels, pixels[0]) && send_request(fd, 1, RawPixels, pixels[1]);
+	ok &= fd >= 0 && shutdown(fd, SHUT_WR) == 0;
+	ok &= check_replies("half closed connection", receive(fd, 1 << 16), raw_replies);
+	close(fd);
+
+	// Frames smaller than a sample area, or with no part in them, can't be cropped and must
+	// be refused rather than condensed. A frame with a part is scored like its pixels
+	const std::vector<uint8_t> part_frame = make_png(200, 200, 80);
+	uint8_t part_pixels[64];
+	ok &= preprocess::condense_request(part_frame, part_pixels);
+	fd = connect_client(config.socket_path);
+	ok &= fd >= 0 && send_request(fd, 0, PngFrame, make_png(4, 4, 2)) && send_request(fd, 1, PngFrame, make_png(40, 40, 0)) &&
+		  send_request(fd, 2, PngFrame, part_frame);
+	ok &= fd >= 0 && shutdown(fd, SHUT_WR) == 0;
+	ok &= check_replies("png frames", receive(fd, 1 << 16), {{0, DecodeFailed, 0, 0}, {1, DecodeFailed, 0, 0}, InferenceServer::classify(*net, 2, part_pixels)});
+	close(fd);
+
+	server.stop();
+	serving.join();
+	return ok ? 0 : 1;
+}